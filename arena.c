@@ -0,0 +1,116 @@
+/*
+
+ arena.c -- hand out the memory one message needs from a few large
+            blocks, and take it all back in one go
+
+ See COPYRIGHT for the license
+
+*/
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ssmtp.h"
+
+#define ARENA_ALIGN 16		/* Enough for anything we keep in one */
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size;		/* What there is after the header */
+	size_t used;
+};
+
+/* Where the memory of a block starts */
+#define ARENA_HDR ((sizeof(struct arena_block) + (ARENA_ALIGN - 1)) \
+	& ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_DATA(b) ((char *)(b) + ARENA_HDR)
+
+/*
+arena_alloc() -- Allocate n bytes from a
+*/
+void *arena_alloc(struct arena *a, size_t n)
+{
+	struct arena_block *b = a->blocks;
+	size_t size;
+
+	n = ((n + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1));
+
+	if((b == (struct arena_block *)NULL) || ((b->size - b->used) < n)) {
+		size = ((n > ARENA_SZ) ? n : ARENA_SZ);
+
+		if((b = (struct arena_block *)malloc(ARENA_HDR + size)) == NULL) {
+			die("arena_alloc() -- malloc() failed");
+		}
+		b->size = size;
+		b->used = 0;
+		b->next = a->blocks;
+		a->blocks = b;
+	}
+
+	a->last = (ARENA_DATA(b) + b->used);
+	b->used += n;
+
+	return(a->last);
+}
+
+/*
+arena_grow() -- realloc() for what arena_alloc() gave, old bytes of it
+	The latest allocation grows in place if there is room
+*/
+void *arena_grow(struct arena *a, void *p, size_t old, size_t n)
+{
+	struct arena_block *b = a->blocks;
+	size_t at;
+	void *q;
+
+	if(p && (p == a->last)) {
+		at = ((char *)p - ARENA_DATA(b));
+		n = ((n + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1));
+
+		if((at + n) <= b->size) {
+			b->used = (at + n);
+			return(p);
+		}
+	}
+
+	q = arena_alloc(a, n);
+	if(p) {
+		(void)memcpy(q, p, old);
+	}
+
+	return(q);
+}
+
+/*
+arena_strdup() -- strdup() into a
+*/
+char *arena_strdup(struct arena *a, const char *str)
+{
+	size_t len = (strlen(str) + 1);
+
+	return((char *)memcpy(arena_alloc(a, len), str, len));
+}
+
+/*
+arena_reset() -- Give back everything allocated from a at once
+	One block is kept for the next message
+*/
+void arena_reset(struct arena *a)
+{
+	struct arena_block *b, *next, *keep = (struct arena_block *)NULL;
+
+	for(b = a->blocks; b; b = next) {
+		next = b->next;
+
+		if((keep == (struct arena_block *)NULL) && (b->size == ARENA_SZ)) {
+			keep = b;
+			keep->next = (struct arena_block *)NULL;
+			keep->used = 0;
+		}
+		else {
+			free(b);
+		}
+	}
+
+	a->blocks = keep;
+	a->last = NULL;
+}
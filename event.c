@@ -0,0 +1,283 @@
+/*
+
+ event.c -- wait for sockets against deadlines, and run several SMTP
+            sessions at once as tasks of one process
+
+ A task has a stack of its own and runs until it has to wait for a
+ socket.  ev_poll() then hands over to ev_run(), which waits for the
+ sockets of every task at once with epoll and resumes whichever task
+ has its socket ready or has run out of time.  Outside a task
+ ev_poll() is just poll(), and without ucontext or epoll tasks simply
+ run one after the other.
+
+ See COPYRIGHT for the license
+
+*/
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <poll.h>
+#if defined(HAVE_UCONTEXT_H) && defined(HAVE_MAKECONTEXT) \
+	&& defined(HAVE_SYS_EPOLL_H) && defined(HAVE_EPOLL_CREATE1)
+#define EV_TASKS
+#include <ucontext.h>
+#include <sys/epoll.h>
+#endif
+#include "ssmtp.h"
+
+#define EV_STACK_SZ (1024 * 1024)	/* Resolver and TLS code want a lot */
+#define EV_EVENTS 64			/* Most events taken per epoll_wait() */
+
+#ifdef EV_TASKS
+struct ev_task {
+	ucontext_t ctx;
+	void (*func)(void *);
+	void *arg;
+	char *stack;
+	struct pollfd *fds;	/* What it waits for, as given to ev_poll() */
+	int nfds;
+	int ready;		/* How many of fds have revents */
+	long deadline;		/* When it stops waiting, -1 for never */
+	bool_t waiting;
+	bool_t done;
+	struct ev_task *next;
+};
+
+struct ev_task *ev_tasks = (struct ev_task *)NULL;
+struct ev_task *ev_current = (struct ev_task *)NULL;
+struct ev_task **ev_waiters = (struct ev_task **)NULL;	/* Indexed by fd */
+int ev_waiters_len = 0;
+ucontext_t ev_loop;
+int ev_fd = -1;
+#endif
+
+/*
+msec() -- Milliseconds since the first call, for timing things
+*/
+long msec(void)
+{
+	static time_t base = 0;
+	struct timeval tv;
+
+	(void)gettimeofday(&tv, (struct timezone *)NULL);
+	if(base == 0) {
+		base = tv.tv_sec;
+	}
+
+	return(((tv.tv_sec - base) * 1000) + (tv.tv_usec / 1000));
+}
+
+/*
+ev_left() -- What is left until deadline, as a poll() timeout
+*/
+int ev_left(long deadline)
+{
+	long now = msec();
+
+	return((deadline > now) ? (int)(deadline - now) : 0);
+}
+
+#ifdef EV_TASKS
+/*
+ev_watch() -- Add the fds a task waits for to, or take them out of,
+	the epoll set
+*/
+int ev_watch(struct ev_task *t, int op)
+{
+	struct epoll_event ev;
+	int i, fd;
+
+	for(i = 0; i < t->nfds; i++) {
+		fd = t->fds[i].fd;
+
+		if(fd >= ev_waiters_len) {
+			ev_waiters = (struct ev_task **)realloc(ev_waiters,
+				((fd + 1) * sizeof(struct ev_task *)));
+			if(ev_waiters == (struct ev_task **)NULL) {
+				die("ev_watch() -- realloc() failed");
+			}
+			ev_waiters_len = (fd + 1);
+		}
+		ev_waiters[fd] = t;
+
+		/* The EPOLL and POLL event bits are the same */
+		(void)memset(&ev, 0, sizeof(ev));
+		ev.events = t->fds[i].events;
+		ev.data.fd = fd;
+
+		if((epoll_ctl(ev_fd, op, fd, &ev) == -1) && (op == EPOLL_CTL_ADD)) {
+			while(i-- > 0) {
+				(void)epoll_ctl(ev_fd, EPOLL_CTL_DEL, t->fds[i].fd, &ev);
+			}
+			return(-1);
+		}
+	}
+
+	return(0);
+}
+
+/*
+ev_start() -- Where a task begins, and ends
+*/
+void ev_start(void)
+{
+	ev_current->func(ev_current->arg);
+	ev_current->done = True;
+
+	/* Back to ev_run(), through uc_link */
+}
+#endif
+
+/*
+ev_poll() -- poll(), except that inside a task the others run meanwhile
+*/
+int ev_poll(struct pollfd *fds, int n, int timeout)
+{
+	long deadline = ((timeout < 0) ? -1 : (msec() + timeout));
+	int res;
+
+#ifdef EV_TASKS
+	if(ev_current) {
+		int i;
+
+		ev_current->fds = fds;
+		ev_current->nfds = n;
+		ev_current->ready = 0;
+		ev_current->deadline = deadline;
+
+		for(i = 0; i < n; i++) {
+			fds[i].revents = 0;
+		}
+
+		if(ev_watch(ev_current, EPOLL_CTL_ADD) == 0) {
+			ev_current->waiting = True;
+			(void)swapcontext(&ev_current->ctx, &ev_loop);
+
+			return(ev_current->ready);
+		}
+		/* Not something epoll takes, so just wait for it */
+	}
+#endif
+
+	while(((res = poll(fds, n, ((deadline == -1) ? -1 : ev_left(deadline)))) == -1)
+		&& (errno == EINTR)) {
+		/* Nothing */ ;
+	}
+
+	return(res);
+}
+
+/*
+ev_spawn() -- Start func(arg) as a task, to run in ev_run()
+*/
+void ev_spawn(void (*func)(void *), void *arg)
+{
+#ifdef EV_TASKS
+	struct ev_task *t, **tp;
+
+	if((ev_fd == -1) && ((ev_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)) {
+		log_event(LOG_ERR, "epoll_create1() failed, running tasks in turn");
+	}
+	else if(((t = (struct ev_task *)calloc(1, sizeof(struct ev_task))) == NULL)
+		|| ((t->stack = (char *)malloc(EV_STACK_SZ)) == (char *)NULL)) {
+		die("ev_spawn() -- malloc() failed");
+	}
+	else if(getcontext(&t->ctx) == -1) {
+		die("ev_spawn() -- getcontext() failed");
+	}
+	else {
+		t->func = func;
+		t->arg = arg;
+		t->ctx.uc_stack.ss_sp = t->stack;
+		t->ctx.uc_stack.ss_size = EV_STACK_SZ;
+		t->ctx.uc_link = &ev_loop;
+		makecontext(&t->ctx, ev_start, 0);
+
+		/* They start in the order they were spawned */
+		for(tp = &ev_tasks; *tp; tp = &(*tp)->next) {
+			/* Nothing */ ;
+		}
+		*tp = t;
+
+		return;
+	}
+#endif
+
+	func(arg);
+}
+
+/*
+ev_run() -- Run the tasks ev_spawn() started until all of them are done
+*/
+void ev_run(void)
+{
+#ifdef EV_TASKS
+	struct epoll_event events[EV_EVENTS];
+	struct ev_task *t, **tp;
+	int i, j, n, wait;
+	long now;
+
+	while(ev_tasks) {
+		/* Run every task that can until it waits or is done */
+		for(tp = &ev_tasks; (t = *tp); ) {
+			if(t->waiting == False) {
+				ev_current = t;
+				(void)swapcontext(&ev_loop, &t->ctx);
+				ev_current = (struct ev_task *)NULL;
+			}
+
+			if(t->done) {
+				*tp = t->next;
+				free(t->stack);
+				free(t);
+			}
+			else {
+				tp = &t->next;
+			}
+		}
+
+		if(ev_tasks == (struct ev_task *)NULL) {
+			break;
+		}
+
+		/* Sleep until the first deadline at most */
+		wait = -1;
+		for(t = ev_tasks; t; t = t->next) {
+			if((t->deadline != -1)
+				&& ((wait == -1) || (ev_left(t->deadline) < wait))) {
+				wait = ev_left(t->deadline);
+			}
+		}
+
+		if((n = epoll_wait(ev_fd, events, EV_EVENTS, wait)) == -1) {
+			if(errno != EINTR) {
+				die("epoll_wait() failed: %s", strerror(errno));
+			}
+			n = 0;
+		}
+
+		for(i = 0; i < n; i++) {
+			t = ev_waiters[events[i].data.fd];
+
+			for(j = 0; j < t->nfds; j++) {
+				if(t->fds[j].fd == events[i].data.fd) {
+					t->fds[j].revents = events[i].events;
+					t->ready++;
+				}
+			}
+		}
+
+		now = msec();
+		for(t = ev_tasks; t; t = t->next) {
+			if(t->waiting && (t->ready
+				|| ((t->deadline != -1) && (t->deadline <= now)))) {
+				(void)ev_watch(t, EPOLL_CTL_DEL);
+				t->waiting = False;
+			}
+		}
+	}
+#endif
+}
@@ -0,0 +1,43 @@
+/*
+
+ peer.c -- find out which user is on the other end of a local socket
+
+ This lives apart from ssmtp.c because struct ucred needs _GNU_SOURCE.
+
+ See COPYRIGHT for the license
+
+*/
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#include "ssmtp.h"
+
+/*
+peer_uid() -- Find the user that connected the AF_UNIX socket fd
+	Returns -1 if the system cannot tell
+*/
+int peer_uid(int fd, uid_t *uid)
+{
+#if defined(SO_PEERCRED)
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+		return(-1);
+	}
+	*uid = cred.uid;
+
+	return(0);
+#elif defined(HAVE_GETPEEREID)
+	gid_t gid;
+
+	return(getpeereid(fd, uid, &gid));
+#else
+	errno = ENOSYS;
+
+	return(-1);
+#endif
+}
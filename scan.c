@@ -0,0 +1,155 @@
+/*
+
+ scan.c -- find the line breaks in message text that need work before
+           it goes out: bare <LF>s, and for DATA those before a dot
+
+ The text is looked at 32 or 16 characters at a time with AVX2 or
+ SSE2 where the CPU has them, and with memchr() otherwise.  Text that
+ already has <CR/LF>s and no leading dots has nothing to find, and is
+ passed over at the speed of the loads.
+
+ See COPYRIGHT for the license
+
+*/
+#include <sys/types.h>
+#include <string.h>
+#if defined(HAVE_IMMINTRIN_H) && defined(__GNUC__) && defined(__SSE2__)
+#define SCAN_SSE2
+#if (__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)) || defined(__clang__)
+#define SCAN_AVX2
+#endif
+#include <immintrin.h>
+#endif
+#include "ssmtp.h"
+
+/* Whether the <LF> at p, with prev before it, needs work */
+#define SCAN_HIT(p, end, prev, stuff) ((*(p) == '\n') && (((prev) != '\r') \
+	|| ((stuff) && (((p) + 1) < (end)) && (*((p) + 1) == '.'))))
+
+/*
+scan_byte() -- scan_body() without vectors
+*/
+char *scan_byte(char *p, char *end, char prev, bool_t stuff)
+{
+	char *nl;
+
+	for(; (nl = memchr(p, '\n', (end - p))); prev = '\n', p = (nl + 1)) {
+		if(SCAN_HIT(nl, end, ((nl > p) ? *(nl - 1) : prev), stuff)) {
+			return(nl);
+		}
+	}
+
+	return((char *)NULL);
+}
+
+#ifdef SCAN_SSE2
+/*
+scan_sse2() -- scan_body() 16 characters at a time
+*/
+char *scan_sse2(char *p, char *end, char prev, bool_t stuff)
+{
+	__m128i lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+	__m128i dot = _mm_set1_epi8('.'), at, hit;
+	unsigned int mask;
+
+	/* Only the first character has its predecessor elsewhere */
+	if(p >= end) {
+		return((char *)NULL);
+	}
+	else if(SCAN_HIT(p, end, prev, stuff)) {
+		return(p);
+	}
+	p++;
+
+	/* Each step with a <LF> looks at the characters before and after, too */
+	while((end - p) > 16) {
+		at = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)p), lf);
+
+		if(_mm_movemask_epi8(at)) {
+			hit = _mm_andnot_si128(
+				_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(p - 1)), cr), at);
+
+			if(stuff) {
+				hit = _mm_or_si128(hit, _mm_and_si128(at,
+					_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(p + 1)), dot)));
+			}
+
+			if((mask = (unsigned int)_mm_movemask_epi8(hit))) {
+				return(p + __builtin_ctz(mask));
+			}
+		}
+		p += 16;
+	}
+
+	return(scan_byte(p, end, *(p - 1), stuff));
+}
+#endif
+
+#ifdef SCAN_AVX2
+/*
+scan_avx2() -- scan_body() 32 characters at a time
+*/
+__attribute__((target("avx2")))
+char *scan_avx2(char *p, char *end, char prev, bool_t stuff)
+{
+	__m256i lf = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+	__m256i dot = _mm256_set1_epi8('.'), at, hit;
+	unsigned int mask;
+
+	if(p >= end) {
+		return((char *)NULL);
+	}
+	else if(SCAN_HIT(p, end, prev, stuff)) {
+		return(p);
+	}
+	p++;
+
+	while((end - p) > 32) {
+		at = _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)p), lf);
+
+		if(_mm256_movemask_epi8(at)) {
+			hit = _mm256_andnot_si256(
+				_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(p - 1)), cr), at);
+
+			if(stuff) {
+				hit = _mm256_or_si256(hit, _mm256_and_si256(at,
+					_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(p + 1)), dot)));
+			}
+
+			if((mask = (unsigned int)_mm256_movemask_epi8(hit))) {
+				return(p + __builtin_ctz(mask));
+			}
+		}
+		p += 32;
+	}
+
+	/* The rest is shorter than a step of either */
+	return(scan_byte(p, end, *(p - 1), stuff));
+}
+#endif
+
+/*
+scan_body() -- Find the first <LF> from p on that msg_body() has to do
+	something about: one without a <CR> before it (prev is the
+	character before p) or, with stuff, one with a dot after it.
+	Returns NULL if there is none before end
+*/
+char *scan_body(char *p, char *end, char prev, bool_t stuff)
+{
+#ifdef SCAN_AVX2
+	static int avx2 = -1;
+
+	if(avx2 == -1) {
+		avx2 = (__builtin_cpu_supports("avx2") ? 1 : 0);
+	}
+
+	if(avx2) {
+		return(scan_avx2(p, end, prev, stuff));
+	}
+#endif
+#ifdef SCAN_SSE2
+	return(scan_sse2(p, end, prev, stuff));
+#else
+	return(scan_byte(p, end, prev, stuff));
+#endif
+}
@@ -15,17 +15,28 @@
 #define VERSION "2.60.4"
 
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef HAVE_RES_SEARCH
+#include <arpa/nameser.h>
+#include <resolv.h>
+#endif
 #include <sys/param.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <syslog.h>
 #include <signal.h>
-#include <setjmp.h>
 #include <string.h>
 #include <ctype.h>
 #include <netdb.h>
+#include <dirent.h>
+#include <time.h>
 #ifdef HAVE_SSL
 #include <openssl/crypto.h>
 #include <openssl/x509.h>
@@ -41,12 +52,17 @@
 #include <errno.h>
 #include "ssmtp.h"
 
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
 #define CONNECT_TIMEOUT
 #define READ_TIMEOUT
 #define WRITE_TIMEOUT
 
 bool_t have_date = False;
 bool_t have_from = False;
+bool_t body_7bit = False;	/* Content-Transfer-Encoding says it is */
 #ifdef HASTO_OPTION
 bool_t have_to = False;
 #endif
@@ -57,6 +73,13 @@ bool_t rewrite_domain = False;
 bool_t use_tls = False;			/* Use SSL to transfer mail to HUB */
 bool_t use_starttls = False;		/* SSL only after STARTTLS (RFC2487) */
 bool_t use_cert = False;		/* Use a certificate to transfer SSL mail */
+int zero_copy = ZC_OFF;			/* Body on stdin needs no reformatting */
+bool_t minus_q = False;			/* Run the queue */
+bool_t minus_bp = False;		/* List the queue */
+bool_t minus_bd = False;		/* Run as the connection pool daemon */
+int delivery_mode = DM_INTERACTIVE;
+int max_connections = 1;		/* Sessions per mailhub in a queue run */
+int delivery_mode_cmdline = 0;
 
 #define ARPADATE_LENGTH 32		/* Current date in RFC format */
 char arpadate[ARPADATE_LENGTH];
@@ -75,12 +98,23 @@ char *prog = NULL;
 char *root = NULL;
 char *tls_cert = "/etc/ssl/certs/ssmtp.pem";	/* Default Certificate */
 char *uad = NULL;
+char *queue_dir = NULL;			/* Undelivered messages wait here */
+uid_t queue_uid = 0;			/* Who QueueDir and its files belong to */
+FILE *spool_fp = NULL;			/* Message text goes here while queueing */
+char *pool_socket = NULL;		/* Where the -bd daemon listens */
+char *cache_dir = NULL;			/* State kept between runs */
+char *mx_domains = NULL;		/* Mail for these goes to their MX hosts */
+struct route_rule route_rules[MAXROUTES];	/* Mailhubs for some domains */
+int route_rule_count = 0;
 
 int connect_timeout = 3000; /* 3 sec */
 int read_timeout = 3000; /* 3 sec */
 int write_timeout = 3000; /* 3 sec */
 
-headers_t headers, *ht;
+char *header_buf = NULL;		/* The headers we were given, see header_parse() */
+size_t header_len = 0, header_size = 0;
+struct header *headers = NULL;
+int header_count = 0, header_max = 0;
 
 #ifdef DEBUG
 int log_level = 1;
@@ -92,13 +126,32 @@ int port = 25;
 int p_family = PF_UNSPEC;		/* Protocol family used in SMTP connection */
 #endif
 
-jmp_buf TimeoutJmpBuf;			/* Timeout waiting for input from network */
 
 rcpt_t rcpt_list, *rt;
 
-#ifdef HAVE_SSL
-SSL *ssl;
-#endif
+/* Headers, recipients, addresses and queue entries: what only matters
+   for the message at hand, given back at once by queue_free() */
+struct arena msg_arena;
+
+/* The addresses of the RCPT list, hashed, see rcpt_seen() */
+char **rcpt_seen_list = (char **)NULL;
+size_t rcpt_seen_size = 0, rcpt_seen_count = 0;
+
+/* Open connections to mailhubs, indexed by their socket */
+struct smtp_conn **smtp_conns = NULL;
+int smtp_conns_len = 0;
+
+/* Service extensions we know of; each connection gets a copy that
+   smtp_ehlo() fills in */
+struct esmtp_ext esmtp_ext[] = {
+	{ "PIPELINING", False, NULL },	/* RFC2920 */
+	{ "SIZE", False, NULL },	/* RFC1870 */
+	{ "8BITMIME", False, NULL },	/* RFC6152 */
+	{ "CHUNKING", False, NULL },	/* RFC3030 */
+	{ "STARTTLS", False, NULL },	/* RFC3207 */
+	{ "AUTH", False, NULL },	/* RFC4954 */
+	{ NULL, False, NULL }
+};
 
 #ifdef MD5AUTH
 static char hextab[]="0123456789abcdef";
@@ -122,7 +175,7 @@ int ssmtp_poll(int sock, int op, int timeout_msec) /* {{{ */
 	fds[0].events = op | POLLERR;
 
 	errno = 0;
-	poll_res = poll(fds, 1, timeout_msec);
+	poll_res = ev_poll(fds, 1, timeout_msec);
 
 	switch (poll_res) {
 		case 0: /* timeout */
@@ -171,9 +224,15 @@ void log_event(int priority, char *format, ...)
 }
 
 void smtp_write(int fd, char *format, ...);
+ssize_t fd_flush(int fd);
 int smtp_read(int fd, char *response);
 int smtp_read_all(int fd, char *response);
 int smtp_okay(int fd, char *response);
+int smtp_ehlo(int fd, char *response);
+int smtp_fail(char *response, char *format, ...);
+void smtp_close(int fd);
+int pool_send(queue_t *q, FILE *stream, bool_t add_headers, char *response);
+bool_t queue_check(void);
 
 /*
 dead_letter() -- Save stdin to ~/dead.letter if possible
@@ -315,9 +374,7 @@ char *addr_parse(char *str)
 #endif
 
 	/* Simple case with email address enclosed in <> */
-	if((p = strdup(str)) == (char *)NULL) {
-		die("addr_parse(): strdup()");
-	}
+	p = arena_strdup(&msg_arena, str);
 
 	if((q = strchr(p, '<'))) {
 		q++;
@@ -374,37 +431,10 @@ char *append_domain(char *str)
 														) == -1) {
 				die("append_domain() -- snprintf() failed");
 		}
-		return(strdup(buf));
-	}
-
-	return(strdup(str));
-}
-
-/*
-standardise() -- Trim off '\n's and double leading dots
-*/
-void standardise(char *str)
-{
-	size_t sl;
-	char *p;
-
-	if((p = strchr(str, '\n'))) {
-		*p = '\0';
+		return(arena_strdup(&msg_arena, buf));
 	}
 
-	/* Any line beginning with a dot has an additional dot inserted;
-	not just a line consisting solely of a dot. Thus we have to slide
-	the buffer down one */
-	sl = strlen(str);
-
-	if(*str == '.') {
-		if((sl + 2) > BUF_SZ) {
-			die("standardise() -- Buffer overflow");
-		}
-		(void)memmove((str + 1), str, (sl + 1));	/* Copy trailing \0 */
-
-		*str = '.';
-	}
+	return(str);
 }
 
 /*
@@ -483,7 +513,8 @@ char *from_strip(char *str)
 	(void)fprintf(stderr, "*** from_strip(): p = [%s]\n", p);
 #endif
 
-	return(strdup(p));
+	/* Already a copy of its own */
+	return(p);
 }
 
 /*
@@ -527,112 +558,236 @@ char *from_format(char *str, bool_t override_from)
 	(void)fprintf(stderr, "*** from_format(): buf = [%s]\n", buf);
 #endif
 
-	return(strdup(buf));
+	return(arena_strdup(&msg_arena, buf));
 }
 
 /*
-rcpt_save() -- Store entry into RCPT list
+rcpt_char() -- A character of an address as it is kept: <CR>, <LF>
+	and <TAB> of folded headers become spaces
 */
-void rcpt_save(char *str)
+int rcpt_char(int c)
 {
-	char *p;
+	return(((c == '\t') || (c == '\n') || (c == '\r')) ? ' ' : c);
+}
 
-# if 1
-	/* Horrible botch for group stuff */
-	p = str;
-	while(*p) p++;
+/*
+rcpt_domain() -- Where the domain of the address str, len bytes of it,
+	starts, or len if there is none
+*/
+size_t rcpt_domain(char *str, size_t len)
+{
+	size_t i = len;
 
-	if(*--p == ';') {
-		return;
+	while(i > 0) {
+		if(str[--i] == '@') {
+			return(i + 1);
+		}
 	}
-#endif
 
-#if 0
-	(void)fprintf(stderr, "*** rcpt_save(): str = [%s]\n", str);
-#endif
+	return(len);
+}
+
+/*
+rcpt_hash() -- Hash an address, ignoring the case of its domain
+*/
+unsigned long rcpt_hash(char *str, size_t len)
+{
+	unsigned long h = 5381;
+	size_t i, at = rcpt_domain(str, len);
+	int c;
+
+	for(i = 0; i < len; i++) {
+		c = rcpt_char((unsigned char)str[i]);
+		h = ((h * 33) ^ (unsigned long)((i < at) ? c : tolower(c)));
+	}
+
+	return(h);
+}
+
+/*
+rcpt_seen() -- Remember an address, len bytes of str, unless it is
+	one the recipient list has already.  Returns NULL for those, or the
+	address to keep, which is a copy in msg_arena if copy is True
+*/
+char *rcpt_seen(char *str, size_t len, bool_t copy)
+{
+	size_t i, j, at = rcpt_domain(str, len), size;
+	char **old, *p;
+
+	/* Keep it at most half full */
+	if((rcpt_seen_count * 2) >= rcpt_seen_size) {
+		old = rcpt_seen_list;
+		size = rcpt_seen_size;
+
+		rcpt_seen_size = (size ? (size * 2) : 256);
+		rcpt_seen_list = (char **)arena_alloc(&msg_arena,
+			(rcpt_seen_size * sizeof(char *)));
+		(void)memset(rcpt_seen_list, 0, (rcpt_seen_size * sizeof(char *)));
+
+		for(i = 0; i < size; i++) {
+			if((p = old[i])) {
+				j = (rcpt_hash(p, strlen(p)) & (rcpt_seen_size - 1));
+				while(rcpt_seen_list[j]) {
+					j = ((j + 1) & (rcpt_seen_size - 1));
+				}
+				rcpt_seen_list[j] = p;
+			}
+		}
+	}
+
+	for(i = (rcpt_hash(str, len) & (rcpt_seen_size - 1)); (p = rcpt_seen_list[i]);
+		i = ((i + 1) & (rcpt_seen_size - 1))) {
+		for(j = 0; (j < len) && p[j]; j++) {
+			if((j < at) ? (p[j] != rcpt_char((unsigned char)str[j]))
+				: (tolower((unsigned char)p[j])
+					!= tolower(rcpt_char((unsigned char)str[j])))) {
+				break;
+			}
+		}
+
+		if((j == len) && (p[j] == '\0')) {
+			return((char *)NULL);
+		}
+	}
 
+	if(copy) {
+		p = (char *)arena_alloc(&msg_arena, (len + 1));
+		for(j = 0; j < len; j++) {
+			p[j] = rcpt_char((unsigned char)str[j]);
+		}
+		p[len] = '\0';
+	}
+	else {
+		p = str;
+	}
+	rcpt_seen_list[i] = p;
+	rcpt_seen_count++;
+
+	return(p);
+}
+
+/*
+rcpt_start() -- Make list the RCPT list that rcpt_save() adds to
+*/
+void rcpt_start(rcpt_t *list)
+{
+	rt = list;
+	rt->next = (rcpt_t *)NULL;
+
+	rcpt_seen_list = (char **)NULL;
+	rcpt_seen_size = rcpt_seen_count = 0;
+}
+
+/*
+rcpt_span() -- Store the address str, len bytes of it, into RCPT list
+	unless it is there already
+*/
+void rcpt_span(char *str, size_t len)
+{
 	/* Ignore missing usernames */
-	if(*str == '\0') {
+	if(len == 0) {
 		return;
 	}
 
-	if((rt->string = strdup(str)) == (char *)NULL) {
-		die("rcpt_save() -- strdup() failed");
+# if 1
+	/* Horrible botch for group stuff */
+	if(str[(len - 1)] == ';') {
+		return;
 	}
+#endif
 
-	rt->next = (rcpt_t *)malloc(sizeof(rcpt_t));
-	if(rt->next == (rcpt_t *)NULL) {
-		die("rcpt_save() -- malloc() failed");
+	if((str = rcpt_seen(str, len, True)) == (char *)NULL) {
+		return;
 	}
+
+	rt->string = str;
+	rt->next = (rcpt_t *)arena_alloc(&msg_arena, sizeof(rcpt_t));
 	rt = rt->next;
 
 	rt->next = (rcpt_t *)NULL;
 }
 
 /*
-rcpt_parse() -- Break To|Cc|Bcc into individual addresses
+rcpt_save() -- Store entry into RCPT list
 */
-void rcpt_parse(char *str)
+void rcpt_save(char *str)
 {
-	bool_t in_quotes = False, got_addr = False;
-	char *p, *q, *r;
-
 #if 0
-	(void)fprintf(stderr, "*** rcpt_parse(): str = [%s]\n", str);
+	(void)fprintf(stderr, "*** rcpt_save(): str = [%s]\n", str);
 #endif
 
-	if((p = strdup(str)) == (char *)NULL) {
-		die("rcpt_parse(): strdup() failed");
+	rcpt_span(str, strlen(str));
+}
+
+/*
+rcpt_addr() -- Find the address in the text from start to end, as
+	addr_parse() does, and store it
+	lt and gt are where the first '<' and the '>' after it are, if any
+*/
+void rcpt_addr(char *start, char *end, char *lt, char *gt)
+{
+	char *p;
+
+	if(lt) {
+		start = (lt + 1);
+		if(gt) {
+			end = gt;
+		}
 	}
-	q = p;
+	else {
+		while((start < end) && isspace((unsigned char)*start)) start++;
+		if((start < end) && (*start == '(')) {
+			while((start < end) && (*start++ != ')'));
+		}
+		while((start < end) && isspace((unsigned char)*start)) start++;
 
-	/* Replace <CR>, <LF> and <TAB> */
-	while(*q) {
-		switch(*q) {
-			case '\t':
-			case '\n':
-			case '\r':
-					*q = ' ';
+		while((end > start) && isspace((unsigned char)end[-1])) end--;
+		if((end > start) && (end[-1] == ')')) {
+			for(p = (end - 1); (p > start) && (*--p != '('); );
+			if(*p == '(') {
+				end = p;
+			}
 		}
-		q++;
+		while((end > start) && isspace((unsigned char)end[-1])) end--;
 	}
-	q = p;
+
+	rcpt_span(start, (size_t)(end - start));
+}
+
+/*
+rcpt_parse() -- Break To|Cc|Bcc into individual addresses
+	One pass over the header, which is left as it is: the addresses
+	are found in place and only those new to the list are copied
+*/
+void rcpt_parse(char *str)
+{
+	bool_t in_quotes = False;
+	char *p, *start, *lt = (char *)NULL, *gt = (char *)NULL;
 
 #if 0
-	(void)fprintf(stderr, "*** rcpt_parse(): q = [%s]\n", q);
+	(void)fprintf(stderr, "*** rcpt_parse(): str = [%s]\n", str);
 #endif
 
-	r = q;
-	while(*q) {
-		if(*q == '"') {
+	for(start = p = str; ; p++) {
+		if(*p == '"') {
 			in_quotes = (in_quotes ? False : True);
 		}
-
-		/* End of string? */
-		if(*(q + 1) == '\0') {
-			got_addr = True;
+		else if((*p == '<') && (lt == (char *)NULL)) {
+			lt = p;
 		}
-
-		/* End of address? */
-		if((*q == ',') && (in_quotes == False)) {
-			got_addr = True;
-
-			*q = '\0';
+		else if((*p == '>') && lt && (gt == (char *)NULL)) {
+			gt = p;
 		}
+		else if(((*p == ',') && (in_quotes == False)) || (*p == '\0')) {
+			rcpt_addr(start, p, lt, gt);
 
-		if(got_addr) {
-			while(*r && isspace(*r)) r++;
-
-			rcpt_save(addr_parse(r));
-			r = (q + 1);
-#if 0
-			(void)fprintf(stderr, "*** rcpt_parse(): r = [%s]\n", r);
-#endif
-			got_addr = False;
+			if(*p == '\0') {
+				break;
+			}
+			start = (p + 1);
+			lt = gt = (char *)NULL;
 		}
-		q++;
 	}
-	free(p);
 }
 
 #ifdef MD5AUTH
@@ -691,9 +846,10 @@ char *rcpt_remap(char *str)
 }
 
 /*
-header_save() -- Store entry into header list
+header_save() -- Take note of what a header says
+	Returns False for a header that is to be left out
 */
-void header_save(char *str)
+bool_t header_save(char *str)
 {
 	char *p;
 
@@ -701,125 +857,208 @@ void header_save(char *str)
 	(void)fprintf(stderr, "header_save(): str = [%s]\n", str);
 #endif
 
-	if((p = strdup(str)) == (char *)NULL) {
-		die("header_save() -- strdup() failed");
-	}
-	ht->string = p;
-
-	if(strncasecmp(ht->string, "From:", 5) == 0) {
+	if(strncasecmp(str, "From:", 5) == 0) {
 #if 1
 		/* Hack check for NULL From: line */
-		if(*(p + 6) == '\0') {
-			return;
+		if((str[5] == '\0') || (str[6] == '\0')) {
+			return(False);
 		}
 #endif
 
 #ifdef REWRITE_DOMAIN
 		if(override_from == True) {
-			uad = from_strip(ht->string);
+			uad = from_strip(str);
 		}
 		else {
-			return;
+			return(False);
 		}
 #endif
 		have_from = True;
 	}
 #ifdef HASTO_OPTION
-	else if(strncasecmp(ht->string, "To:" ,3) == 0) {
+	else if(strncasecmp(str, "To:" ,3) == 0) {
 		have_to = True;
 	}
 #endif
-	else if(strncasecmp(ht->string, "Date:", 5) == 0) {
+	else if(strncasecmp(str, "Date:", 5) == 0) {
 		have_date = True;
 	}
+	else if(strncasecmp(str, "Content-Transfer-Encoding:", 26) == 0) {
+		p = (str + 26 + strspn((str + 26), " \t"));
+
+		body_7bit = ((strncasecmp(p, "7bit", 4) == 0)
+			|| (strncasecmp(p, "quoted-printable", 16) == 0)
+			|| (strncasecmp(p, "base64", 6) == 0)) ? True : False;
+	}
 
 	if(minus_t) {
 		/* Need to figure out recipients from the e-mail */
-		if(strncasecmp(ht->string, "To:", 3) == 0) {
-			p = (ht->string + 3);
+		if(strncasecmp(str, "To:", 3) == 0) {
+			p = (str + 3);
 			rcpt_parse(p);
 		}
-		else if(strncasecmp(ht->string, "Bcc:", 4) == 0) {
-			p = (ht->string + 4);
+		else if(strncasecmp(str, "Bcc:", 4) == 0) {
+			p = (str + 4);
 			rcpt_parse(p);
 		}
-		else if(strncasecmp(ht->string, "CC:", 3) == 0) {
-			p = (ht->string + 3);
+		else if(strncasecmp(str, "CC:", 3) == 0) {
+			p = (str + 3);
 			rcpt_parse(p);
 		}
 	}
 
-#if 0
-	(void)fprintf(stderr, "header_save(): ht->string = [%s]\n", ht->string);
-#endif
+	return(True);
+}
+
+/*
+header_grow() -- Make room for at least n more characters in header_buf
+*/
+void header_grow(size_t n)
+{
+	size_t size = header_size;
+
+	if((header_size - header_len) >= n) {
+		return;
+	}
+
+	while((size - header_len) < n) {
+		size = (size ? (size * 2) : (BUF_SZ * 8));
+	}
 
-	ht->next = (headers_t *)malloc(sizeof(headers_t));
-	if(ht->next == (headers_t *)NULL) {
-		die("header_save() -- malloc() failed");
+	header_buf = (char *)arena_grow(&msg_arena, header_buf, header_len, size);
+	header_size = size;
+}
+
+/*
+header_add() -- Make the text from start to end of header_buf a header
+*/
+void header_add(size_t start, size_t end)
+{
+	if(header_count == header_max) {
+		headers = (struct header *)arena_grow(&msg_arena, headers,
+			(header_count * sizeof(struct header)),
+			((header_max ? (header_max * 2) : 64) * sizeof(struct header)));
+		header_max = (header_max ? (header_max * 2) : 64);
 	}
-	ht = ht->next;
 
-	ht->next = (headers_t *)NULL;
+	header_buf[end] = '\0';
+	headers[header_count].off = start;
+	headers[header_count].len = (end - start);
+	header_count++;
 }
 
 /*
 header_parse() -- Break headers into seperate entries
+	The lines are read straight into header_buf, one after another,
+	and each header is no more than where it starts and ends there
 */
 void header_parse(FILE *stream)
 {
-	size_t size = BUF_SZ, len = 0;
-	char *p = (char *)NULL, *q = NULL;
-	bool_t in_header = True;
-	char l = 0;
-	int c;
+	size_t start = 0, n;
+	bool_t at_start = True, have = False;
+	char *line, *p, *q;
+	int i, j;
 
-	while(in_header && ((c = fgetc(stream)) != EOF)) {
-		/* Must have space for up to two more characters, since we
-			may need to insert a '\r' */
-		if((p == (char *)NULL) || (len >= (size - 1))) {
-			size += BUF_SZ;
-
-			p = (char *)realloc(p, (size * sizeof(char)));
-			if(p == (char *)NULL) {
-				die("header_parse() -- realloc() failed");
-			}
-			q = (p + len);
-		}
-		len++;
-
-		if(l == '\n') {
-			switch(c) {
-				case ' ':
-				case '\t':
-						/* Must insert '\r' before '\n's embedded in header
-						   fields otherwise qmail won't accept our mail
-						   because a bare '\n' violates some RFC */
-						
-						*(q - 1) = '\r';	/* Replace previous \n with \r */
-						*q++ = '\n';		/* Insert \n */
-						len++;
-						
-						break;
-
-				case '\n':
-						in_header = False;
+	for(;;) {
+		/* fgets() may fill it, and a <CR> may be added after that */
+		header_grow(BUF_SZ + 2);
+		line = (header_buf + header_len);
 
-				default:
-						*q = '\0';
-						if((q = strrchr(p, '\n'))) {
-							*q = '\0';
-						}
-						header_save(p);
+		if(fgets(line, (int)(header_size - header_len - 1), stream) == NULL) {
+			break;
+		}
+		n = strlen(line);
+
+		/* Headers may arrive with <CR/LF> line breaks; the <CR>s
+		   are put back when the header is sent */
+		if((p = memchr(line, '\r', n))) {
+			for(q = p; p < (line + n); p++) {
+				if(*p != '\r') {
+					*q++ = *p;
+				}
+			}
+			n = (q - line);
+		}
+
+		if(n == 0) {
+			continue;
+		}
 
-						q = p;
-						len = 0;
+		if(at_start) {
+			/* A blank line ends the headers */
+			if(*line == '\n') {
+				break;
+			}
+
+			/* A line that starts with white space goes on with the last
+			   header, otherwise one ends and another starts here */
+			if((have == False) || ((*line != ' ') && (*line != '\t'))) {
+				if(have) {
+					header_add(start, (header_len - 2));
+				}
+				start = header_len;
+				have = True;
 			}
 		}
-		*q++ = c;
+		header_len += n;
+
+		if((at_start = (line[(n - 1)] == '\n'))) {
+			/* Must end lines with <CR/LF>, which stays in a folded header,
+			   otherwise qmail won't accept our mail because a bare '\n'
+			   violates some RFC */
+			header_buf[(header_len - 1)] = '\r';
+			header_buf[header_len++] = '\n';
+		}
+	}
+
+	if(have) {
+		header_add(start, (header_len - (at_start ? 2 : 0)));
+	}
+
+	/* Now that header_buf stays put, see what they say */
+	for(i = 0, j = 0; i < header_count; i++) {
+		if(header_save(header_buf + headers[i].off)) {
+			headers[j++] = headers[i];
+		}
+	}
+	header_count = j;
+}
+
+/*
+delivery_parse() -- Turn a DeliveryMode or -od value into a DM_ constant
+	Only the first letter counts, as with sendmail
+*/
+int delivery_parse(char *str)
+{
+	switch(tolower(*str)) {
+		case 'b':
+			return(DM_BACKGROUND);
 
-		l = c;
+		case 'q':
+		case 'd':
+			return(DM_QUEUE);
 	}
-	(void)free(p);
+
+	return(DM_INTERACTIVE);
+}
+
+/*
+config_value() -- The whole value of a setting, not just its first word
+	q is where it starts in buf, which strtok() has cut up since it
+	was copied to line
+*/
+char *config_value(char *line, char *buf, char *q)
+{
+	char *p, *r;
+
+	r = (line + (q - buf));
+	p = (r + strcspn(r, "\n"));
+	while((p > r) && isspace((unsigned char)p[-1])) {
+		p--;
+	}
+	*p = '\0';
+
+	return(r);
 }
 
 /*
@@ -827,7 +1066,7 @@ read_config() -- Open and parse config file and extract values of variables
 */
 bool_t read_config()
 {
-	char buf[(BUF_SZ + 1)], *p, *q, *r;
+	char buf[(BUF_SZ + 1)], line[(BUF_SZ + 1)], *p, *q, *r;
 	FILE *fp;
 
 	if((fp = fopen(config_file_path, "r")) == NULL) {
@@ -843,6 +1082,9 @@ bool_t read_config()
 		/* Ignore malformed lines and comments */
 		if(strchr(buf, '=') == (char *)NULL) continue;
 
+		/* For values that need more than the first word */
+		(void)strcpy(line, buf);
+
 		/* Parse out keywords */
 		if(((p = strtok(buf, "= \t\n")) != (char *)NULL)
 			&& ((q = strtok(NULL, "= \t\n:")) != (char *)NULL)) {
@@ -856,14 +1098,18 @@ bool_t read_config()
 				}
 			}
 			else if(strcasecmp(p, "MailHub") == 0 && !mailhost_cmdline) {
-				if((mailhost = strdup(q)) == (char *)NULL) {
-					die("parse_config() -- strdup() failed");
+				/* A list of hubs is kept whole, see hub_list() */
+				if(strpbrk((r = config_value(line, buf, q)), ",;/")) {
+					q = r;
 				}
-
-				if((r = strtok(NULL, "= \t\n:")) != NULL) {
+				else if((r = strtok(NULL, "= \t\n:")) != NULL) {
 					port = atoi(r);
 				}
 
+				if((mailhost = strdup(q)) == (char *)NULL) {
+					die("parse_config() -- strdup() failed");
+				}
+
 				if(log_level > 0) {
 					log_event(LOG_INFO, "Set MailHub=\"%s\"\n", mailhost);
 					log_event(LOG_INFO, "Set RemotePort=\"%d\"\n", port);
@@ -1005,6 +1251,101 @@ bool_t read_config()
 					log_event(LOG_INFO, "Set AuthMethod=\"%s\"\n", auth_method);
 				}
 			}
+			else if(strcasecmp(p, "ZeroCopy") == 0) {
+				if((strcasecmp(q, "YES") == 0) || (strcasecmp(q, "CRLF") == 0)) {
+					zero_copy = ZC_CRLF;
+				}
+				else if(strcasecmp(q, "STUFFED") == 0) {
+					zero_copy = ZC_STUFFED;
+				}
+				else {
+					zero_copy = ZC_OFF;
+				}
+
+				if(log_level > 0) {
+					log_event(LOG_INFO, "Set ZeroCopy=\"%s\"\n", q);
+				}
+			}
+			else if(strcasecmp(p, "QueueDir") == 0) {
+				if((queue_dir = strdup(q)) == (char *)NULL) {
+					die("parse_config() -- strdup() failed");
+				}
+
+				if(log_level > 0) {
+					log_event(LOG_INFO, "Set QueueDir=\"%s\"\n", queue_dir);
+				}
+
+				if(queue_check() == False) {
+					free(queue_dir);
+					queue_dir = (char *)NULL;
+				}
+			}
+			else if(strcasecmp(p, "DeliveryMode") == 0 && !delivery_mode_cmdline) {
+				delivery_mode = delivery_parse(q);
+
+				if(log_level > 0) {
+					log_event(LOG_INFO, "Set DeliveryMode=\"%s\"\n", q);
+				}
+			}
+			else if(strcasecmp(p, "CacheDir") == 0) {
+				if((cache_dir = strdup(q)) == (char *)NULL) {
+					die("parse_config() -- strdup() failed");
+				}
+
+				if(log_level > 0) {
+					log_event(LOG_INFO, "Set CacheDir=\"%s\"\n", cache_dir);
+				}
+			}
+			else if(strcasecmp(p, "MXDomains") == 0) {
+				if((mx_domains = strdup(config_value(line, buf, q))) == (char *)NULL) {
+					die("parse_config() -- strdup() failed");
+				}
+
+				if(log_level > 0) {
+					log_event(LOG_INFO, "Set MXDomains=\"%s\"\n", mx_domains);
+				}
+			}
+			else if(strcasecmp(p, "PoolSocket") == 0) {
+				if((pool_socket = strdup(q)) == (char *)NULL) {
+					die("parse_config() -- strdup() failed");
+				}
+
+				if(log_level > 0) {
+					log_event(LOG_INFO, "Set PoolSocket=\"%s\"\n", pool_socket);
+				}
+			}
+			else if(strcasecmp(p, "Route") == 0) {
+				if((r = strdup(config_value(line, buf, q))) == (char *)NULL) {
+					die("parse_config() -- strdup() failed");
+				}
+				q = (r + strcspn(r, " \t"));
+
+				if((*q == '\0') || (route_rule_count == MAXROUTES)) {
+					log_event(LOG_INFO, "Unable to set %s=\"%s\"\n", p, r);
+					free(r);
+					continue;
+				}
+				*q++ = '\0';
+
+				route_rules[route_rule_count].domain = r;
+				route_rules[route_rule_count].hubs = (q + strspn(q, " \t"));
+
+				if(log_level > 0) {
+					log_event(LOG_INFO, "Set Route=\"%s %s\"\n", r,
+						route_rules[route_rule_count].hubs);
+				}
+				route_rule_count++;
+			}
+			else if(strcasecmp(p, "MaxConnections") == 0) {
+				if((max_connections = atoi(q)) < 1) {
+					max_connections = 1;
+				}
+
+				if(log_level > 0) {
+					log_event(LOG_INFO, "Set MaxConnections=\"%d\"\n",
+						max_connections);
+				}
+			}
 			else if (strcasecmp(p, "ConnectTimeout") == 0)
 			{
 				connect_timeout = atoi(q); 
@@ -1028,475 +1369,4105 @@ bool_t read_config()
 }
 
 /*
-smtp_open() -- Open connection to a remote SMTP listener
+smtp_conn() -- Find the state of the connection on fd
 */
-int smtp_open(char *host, int port)
+struct smtp_conn *smtp_conn(int fd)
 {
-	int fd_flags;
-#ifdef INET6
-	struct addrinfo hints, *ai0, *ai;
-	char servname[NI_MAXSERV];
-	int s;
-#else
-	struct sockaddr_in name;
-	struct hostent *hent;
-	int s, namelen;
-#endif
+	if((fd < 0) || (fd >= smtp_conns_len) || (smtp_conns[fd] == NULL)) {
+		die("smtp_conn() -- no connection on fd %d", fd);
+	}
 
-#ifdef HAVE_SSL
-	int err;
+	return(smtp_conns[fd]);
+}
+
+/*
+smtp_conn_new() -- Set up the state of a new connection on fd
+*/
+struct smtp_conn *smtp_conn_new(int fd)
+{
+	struct smtp_conn *c;
+	int i;
+
+	if(fd >= smtp_conns_len) {
+		smtp_conns = (struct smtp_conn **)realloc(smtp_conns,
+			((fd + 1) * sizeof(struct smtp_conn *)));
+		if(smtp_conns == (struct smtp_conn **)NULL) {
+			die("smtp_conn_new() -- realloc() failed");
+		}
+
+		for(i = smtp_conns_len; i <= fd; i++) {
+			smtp_conns[i] = (struct smtp_conn *)NULL;
+		}
+		smtp_conns_len = (fd + 1);
+	}
+
+	if((c = (struct smtp_conn *)calloc(1, sizeof(struct smtp_conn))) == NULL) {
+		die("smtp_conn_new() -- calloc() failed");
+	}
+	c->fd = fd;
+	(void)memcpy(c->ext, esmtp_ext, sizeof(c->ext));
+
+	return(smtp_conns[fd] = c);
+}
+
+/*
+smtp_conn_free() -- Forget the connection on fd
+*/
+void smtp_conn_free(int fd)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+	struct esmtp_ext *e;
+
+	for(e = c->ext; e->keyword; e++) {
+		free(e->params);
+	}
+	free(c->cbuf);
+	free(c->host);
+	free(c);
+
+	smtp_conns[fd] = (struct smtp_conn *)NULL;
+}
+
+/*
+cache_path() -- Where what we learnt about host:port is cached
+	(or, with no host, about all of them)
+	Each user has their own files, so no one can plant them for others
+*/
+bool_t cache_path(char *path, char *kind, char *host, int port)
+{
+	if(cache_dir == (char *)NULL) {
+		return(False);
+	}
+
+	if(host == (char *)NULL) {
+		return(snprintf(path, (MAXPATHLEN + 1), "%s/%s.%d",
+			cache_dir, kind, (int)getuid()) <= MAXPATHLEN);
+	}
+
+	return(snprintf(path, (MAXPATHLEN + 1), "%s/%s-%s:%d.%d",
+		cache_dir, kind, host, port, (int)getuid()) <= MAXPATHLEN);
+}
+
+/*
+cache_open() -- Open a cache file for reading
+	Only files we wrote ourselves are trusted: plain files of our
+	effective uid that no one else can read or write
+*/
+int cache_open(char *path)
+{
+	struct stat st;
+	int fd;
+
+	if((fd = open(path, (O_RDONLY | O_NOFOLLOW))) == -1) {
+		return(-1);
+	}
+
+	if((fstat(fd, &st) == -1) || (S_ISREG(st.st_mode) == 0)
+		|| (st.st_uid != geteuid()) || (st.st_mode & (S_IRWXG | S_IRWXO))) {
+		(void)close(fd);
+		return(-1);
+	}
+
+	return(fd);
+}
+
+/*
+cache_write() -- Replace a cache file with len bytes from buf
+	It is swapped in whole, another run may be reading the old one.
+	The new one is made by mkstemp(), so nothing anyone else put
+	in CacheDir under a name we might pick is ever written through
+*/
+void cache_write(char *path, void *buf, int len)
+{
+	char tmp[(MAXPATHLEN + 16)];
+	int out;
+
+	(void)snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if((out = mkstemp(tmp)) == -1) {
+		return;
+	}
+
+	if(write(out, buf, len) != len) {
+		(void)close(out);
+		(void)unlink(tmp);
+		return;
+	}
+
+	if((close(out) == -1) || (rename(tmp, path) == -1)) {
+		(void)unlink(tmp);
+	}
+}
+
+#ifdef HAVE_SSL
+/*
+tls_ctx() -- The SSL context the connections to the mailhub share, or
+	without ours, the one for everyone else, which has no TLSCert.
+	Each is set up the first time it is used, and kept for the rest
+	of the run
+*/
+SSL_CTX *tls_ctx(bool_t ours)
+{
+	static SSL_CTX *ctxs[2] = { (SSL_CTX *)NULL, (SSL_CTX *)NULL };
+	SSL_CTX *new;
+
+	if(ctxs[ours]) {
+		return(ctxs[ours]);
+	}
+
+	SSL_load_error_strings();
+	SSLeay_add_ssl_algorithms();
+	if((new = SSL_CTX_new(SSLv23_client_method())) == (SSL_CTX *)NULL) {
+		log_event(LOG_ERR, "No SSL support initiated\n");
+		return((SSL_CTX *)NULL);
+	}
+
+	if((use_cert == True) && (ours == True)) {
+		if(SSL_CTX_use_certificate_chain_file(new, tls_cert) <= 0) {
+			perror("Use certfile");
+			SSL_CTX_free(new);
+			return((SSL_CTX *)NULL);
+		}
+
+		if(SSL_CTX_use_PrivateKey_file(new, tls_cert, SSL_FILETYPE_PEM) <= 0) {
+			perror("Use PrivateKey");
+			SSL_CTX_free(new);
+			return((SSL_CTX *)NULL);
+		}
+
+		if(!SSL_CTX_check_private_key(new)) {
+			log_event(LOG_ERR, "Private key does not match the certificate public key\n");
+			SSL_CTX_free(new);
+			return((SSL_CTX *)NULL);
+		}
+	}
+
+	/* So tls_write() can count what went out while the socket was full */
+	(void)SSL_CTX_set_mode(new,
+		(SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER));
+
+	return(ctxs[ours] = new);
+}
+
+/*
+tls_session_load() -- Offer the session cached for host:port, if any,
+	so the handshake can be an abbreviated one
+*/
+void tls_session_load(SSL *ssl, char *host, int port)
+{
+	unsigned char buf[SESSION_SZ];
+	const unsigned char *p;
+	char path[(MAXPATHLEN + 1)];
+	SSL_SESSION *sess;
+	ssize_t len;
+	int fd;
+
+	if((cache_path(path, "tls", host, port) == False)
+		|| ((fd = cache_open(path)) == -1)) {
+		return;
+	}
+
+	len = read(fd, buf, sizeof(buf));
+	(void)close(fd);
+
+	p = buf;
+	if((len <= 0)
+		|| ((sess = d2i_SSL_SESSION((SSL_SESSION **)NULL, &p, len)) == NULL)) {
+		return;
+	}
+
+	if((SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess))
+		> time((time_t *)NULL)) {
+		(void)SSL_set_session(ssl, sess);
+	}
+	SSL_SESSION_free(sess);
+}
+
+/*
+tls_session_save() -- Cache the session of fd for the next run to its mailhub
+	Done once the session is up, when servers have sent their tickets
+*/
+void tls_session_save(int fd)
+{
+	unsigned char buf[SESSION_SZ], *p;
+	char path[(MAXPATHLEN + 1)];
+	struct smtp_conn *c = smtp_conn(fd);
+	SSL_SESSION *sess;
+	int len;
+
+	if((c->ssl == (SSL *)NULL)
+		|| (cache_path(path, "tls", c->host, c->port) == False)) {
+		return;
+	}
+
+	if((sess = SSL_get1_session(c->ssl)) == NULL) {
+		return;
+	}
+
+	len = i2d_SSL_SESSION(sess, (unsigned char **)NULL);
+	if((len > 0) && (len <= sizeof(buf))) {
+		p = buf;
+		len = i2d_SSL_SESSION(sess, &p);
+	}
+	else {
+		len = 0;
+	}
+	SSL_SESSION_free(sess);
+
+	if(len > 0) {
+		cache_write(path, buf, len);
+	}
+}
+
+/*
+tls_wait() -- Wait for what OpenSSL says it needs, after ret came back
+	from an SSL_ call on fd, before the call can be made again
+	Returns 0 when it can, and -1 if it failed for good or by deadline
+*/
+int tls_wait(int fd, int ret, long deadline)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+
+	switch(SSL_get_error(c->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			return((ssmtp_poll(fd, POLLIN, ev_left(deadline))
+				== SSMTP_POLL_SUCCESS) ? 0 : -1);
+
+		case SSL_ERROR_WANT_WRITE:
+			return((ssmtp_poll(fd, POLLOUT, ev_left(deadline))
+				== SSMTP_POLL_SUCCESS) ? 0 : -1);
+	}
+
+	return(-1);
+}
+
+/*
+tls_connect() -- Do the TLS handshake on fd, within connect_timeout
+*/
+int tls_connect(int fd)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+	long deadline = (msec() + connect_timeout);
+	int ret;
+
+	for(;;) {
+		ERR_clear_error();
+		if((ret = SSL_connect(c->ssl)) == 1) {
+			return(0);
+		}
+
+		if(tls_wait(fd, ret, deadline) == -1) {
+			return(-1);
+		}
+	}
+}
+
+/*
+tls_read() -- fd_read() for a TLS connection
+	Waits for the reply to be in by the connection's deadline
+*/
+ssize_t tls_read(int fd, void *buf, size_t count)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+	int ret;
+
+	for(;;) {
+		ERR_clear_error();
+		if((ret = SSL_read(c->ssl, buf, count)) > 0) {
+			return(ret);
+		}
+
+		if(SSL_get_error(c->ssl, ret) == SSL_ERROR_ZERO_RETURN) {
+			return(0);
+		}
+
+		if(tls_wait(fd, ret, c->deadline) == -1) {
+			log_event(LOG_ERR, "SSL_read() failed or timed out");
+			return(-1);
+		}
+	}
+}
+
+/*
+tls_write() -- fd_puts() for a TLS connection
+	Each piece written gives the rest another write_timeout
+*/
+ssize_t tls_write(int fd, const void *buf, size_t count)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+	long deadline = (msec() + write_timeout);
+	size_t done = 0;
+	int ret;
+
+	while(done < count) {
+		/* After a WANT_, OpenSSL wants the very same call again */
+		ERR_clear_error();
+		if((ret = SSL_write(c->ssl, ((const char *)buf + done),
+			(count - done))) > 0) {
+			done += ret;
+			deadline = (msec() + write_timeout);
+			continue;
+		}
+
+		if(tls_wait(fd, ret, deadline) == -1) {
+			log_event(LOG_ERR, "SSL_write() failed or timed out");
+			return(-1);
+		}
+	}
+
+	return(done);
+}
+#endif
+
+/*
+hub_addr_set() -- Fill in a to reach addr (of family) at port
+*/
+void hub_addr_set(struct hub_addr *a, int family, void *addr, int port)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *)&a->sa;
+#ifdef INET6
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&a->sa;
+#endif
+
+	(void)memset(a, 0, sizeof(*a));
+
+#ifdef INET6
+	if(family == AF_INET6) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		(void)memcpy(&sin6->sin6_addr, addr, sizeof(sin6->sin6_addr));
+		a->len = sizeof(*sin6);
+
+		return;
+	}
+#endif
+
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+	(void)memcpy(&sin->sin_addr, addr, sizeof(sin->sin_addr));
+	a->len = sizeof(*sin);
+}
+
+/*
+hub_lookup() -- Resolve host the way the system normally does
+	Returns how many addresses were put in addrs
+*/
+int hub_lookup(char *host, int port, struct hub_addr *addrs, int max)
+{
+#ifdef INET6
+	struct addrinfo hints, *ai0, *ai;
+	char servname[NI_MAXSERV];
+	int n = 0;
+
+	(void)memset(&hints, 0, sizeof(hints));
+	hints.ai_family = p_family;
+	hints.ai_socktype = SOCK_STREAM;
+	(void)snprintf(servname, sizeof(servname), "%d", port);
+
+	if(getaddrinfo(host, servname, &hints, &ai0)) {
+		return(0);
+	}
+
+	for(ai = ai0; ai && (n < max); ai = ai->ai_next) {
+		if(ai->ai_addrlen <= sizeof(addrs[n].sa)) {
+			(void)memset(&addrs[n], 0, sizeof(addrs[n]));
+			(void)memcpy(&addrs[n].sa, ai->ai_addr, ai->ai_addrlen);
+			addrs[n++].len = ai->ai_addrlen;
+		}
+	}
+	freeaddrinfo(ai0);
+
+	return(n);
+#else
+	struct hostent *hent;
+	int n;
+
+	if((hent = gethostbyname(host)) == (struct hostent *)NULL) {
+		return(0);
+	}
+
+	if((hent->h_addrtype != AF_INET)
+		|| (hent->h_length != sizeof(struct in_addr))) {
+		log_event(LOG_ERR, "Buffer overflow in gethostbyname()");
+		return(0);
+	}
+
+	for(n = 0; hent->h_addr_list[n] && (n < max); n++) {
+		hub_addr_set(&addrs[n], AF_INET, hent->h_addr_list[n], port);
+	}
+
+	return(n);
+#endif
+}
+
+/*
+dns_init() -- Give lookups a limit: each name server gets DNS_WAIT
+	seconds, DNS_TRIES times.  getaddrinfo() goes by these too
+*/
+void dns_init(void)
+{
+#ifdef HAVE_RES_SEARCH
+	static bool_t done = False;
+
+	if((done == False) && (res_init() == 0)) {
+		_res.retrans = DNS_WAIT;
+		_res.retry = DNS_TRIES;
+		done = True;
+	}
+#endif
+}
+
+#ifdef HAVE_RES_SEARCH
+/*
+dns_query() -- Add the addresses of type (T_A or T_AAAA) that DNS has
+	for host to addrs[n..max), lowering *ttl to the shortest TTL seen
+	Returns the new number of addresses
+*/
+int dns_query(char *host, int port, int type, struct hub_addr *addrs,
+	int n, int max, unsigned long *ttl)
+{
+	unsigned char ans[(1024 * 4)], *p, *end;
+	int len, i, qd, an, rtype, rlen;
+	unsigned long t;
+
+	if((len = res_search(host, C_IN, type, ans, sizeof(ans)))
+		< (int)sizeof(HEADER)) {
+		return(n);
+	}
+
+	/* The answer may have been truncated to fit */
+	if(len > sizeof(ans)) {
+		len = sizeof(ans);
+	}
+
+	qd = ntohs(((HEADER *)ans)->qdcount);
+	an = ntohs(((HEADER *)ans)->ancount);
+	p = ans + sizeof(HEADER);
+	end = ans + len;
+
+	while(qd-- > 0) {
+		if((i = dn_skipname(p, end)) < 0) {
+			return(n);
+		}
+		p += (i + QFIXEDSZ);
+	}
+
+	/* Any CNAMEs come first and share in the TTL */
+	while((an-- > 0) && (n < max)) {
+		if(((i = dn_skipname(p, end)) < 0) || ((p + i + RRFIXEDSZ) > end)) {
+			break;
+		}
+		p += i;
+
+		GETSHORT(rtype, p);
+		p += INT16SZ;
+		GETLONG(t, p);
+		GETSHORT(rlen, p);
+
+		if((p + rlen) > end) {
+			break;
+		}
+
+		if((rtype == T_A) && (type == T_A) && (rlen == INADDRSZ)) {
+			hub_addr_set(&addrs[n++], AF_INET, p, port);
+		}
+#ifdef INET6
+		else if((rtype == T_AAAA) && (type == T_AAAA) && (rlen == IN6ADDRSZ)) {
+			hub_addr_set(&addrs[n++], AF_INET6, p, port);
+		}
+#endif
+		else if(rtype != T_CNAME) {
+			p += rlen;
+			continue;
+		}
+
+		if(t < *ttl) {
+			*ttl = t;
+		}
+		p += rlen;
+	}
+
+	return(n);
+}
+#endif
+
+/*
+mx_list() -- Write the MX hosts of domain to spec, as a MailHub setting
+	Those of the same preference are separated by commas, and the
+	preferences by semicolons.  A domain without MX records is its own
+	mail host.  Returns 1, 0 if the domain takes no mail (RFC 7505) or
+	does not exist, or -1 if DNS cannot tell right now
+*/
+int mx_list(char *domain, char *spec, size_t size)
+{
+#ifdef HAVE_RES_SEARCH
+	unsigned char ans[(1024 * 4)], *p, *end;
+	char names[MAXHUBS][(MAXDNAME + 1)], name[(MAXDNAME + 1)];
+	int prefs[MAXHUBS], i, j, len, qd, an, n = 0, rtype, rlen, pref;
+	size_t used = 0;
+
+	if((len = res_search(domain, C_IN, T_MX, ans, sizeof(ans)))
+		>= (int)sizeof(HEADER)) {
+		if(len > sizeof(ans)) {
+			len = sizeof(ans);
+		}
+
+		qd = ntohs(((HEADER *)ans)->qdcount);
+		an = ntohs(((HEADER *)ans)->ancount);
+		p = ans + sizeof(HEADER);
+		end = ans + len;
+
+		while(qd-- > 0) {
+			if((i = dn_skipname(p, end)) < 0) {
+				an = 0;
+				break;
+			}
+			p += (i + QFIXEDSZ);
+		}
+
+		while((an-- > 0) && (n < MAXHUBS)) {
+			if(((i = dn_skipname(p, end)) < 0) || ((p + i + RRFIXEDSZ) > end)) {
+				break;
+			}
+			p += i;
+
+			GETSHORT(rtype, p);
+			p += (INT16SZ + INT32SZ);
+			GETSHORT(rlen, p);
+
+			if((p + rlen) > end) {
+				break;
+			}
+
+			if((rtype == T_MX) && (rlen > INT16SZ)) {
+				GETSHORT(pref, p);
+				if(dn_expand(ans, end, p, name, sizeof(name)) < 0) {
+					break;
+				}
+				p += (rlen - INT16SZ);
+
+				/* Keep them sorted by preference */
+				for(j = n++; (j > 0) && (prefs[(j - 1)] > pref); j--) {
+					prefs[j] = prefs[(j - 1)];
+					(void)strcpy(names[j], names[(j - 1)]);
+				}
+				prefs[j] = pref;
+				(void)strcpy(names[j], name);
+				continue;
+			}
+			p += rlen;
+		}
+	}
+
+	if(n > 0) {
+		/* An MX of "." says there is no mail service */
+		if((n == 1) && (names[0][0] == '\0')) {
+			return(0);
+		}
+
+		for(i = 0, *spec = '\0'; i < n; i++) {
+			if((used + strlen(names[i]) + 2) > size) {
+				break;
+			}
+
+			if(i > 0) {
+				spec[used++] = (prefs[i] == prefs[(i - 1)]) ? ',' : ';';
+			}
+			(void)strcpy((spec + used), names[i]);
+			used += strlen(names[i]);
+		}
+
+		return(1);
+	}
+
+	/* Only a domain that is there without MX records falls back to its
+	   address (RFC 5321 5.1); a failed lookup has to be tried again */
+	if(len < 0) {
+		switch(h_errno) {
+			case NO_DATA:
+				break;
+
+			case HOST_NOT_FOUND:
+				return(0);
+
+			default:
+				return(-1);
+		}
+	}
+#endif
+
+	(void)strncpy(spec, domain, (size - 1));
+	spec[(size - 1)] = '\0';
+
+	return(1);
+}
+
+/*
+hub_cache_load() -- Read the addresses cached for host:port from path
+	and when they expire
+	cache_open() only takes a file this user wrote; even so, nothing
+	is kept longer than DNS_MAXTTL and only addresses are read from it
+*/
+int hub_cache_load(char *path, int port, struct hub_addr *addrs, int max,
+	time_t *expires)
+{
+	char buf[(BUF_SZ + 1)], addr[INET6_ADDRSTRLEN];
+	unsigned char raw[sizeof(struct in6_addr)];
+	int fd, n = 0, family;
+	long t;
+	FILE *fp;
+
+	if((fd = cache_open(path)) == -1) {
+		return(0);
+	}
+
+	if((fp = fdopen(fd, "r")) == (FILE *)NULL) {
+		(void)close(fd);
+		return(0);
+	}
+
+	if(fgets(buf, sizeof(buf), fp) && (sscanf(buf, "%ld", &t) == 1)) {
+		*expires = (time_t)t;
+		if(*expires > (time((time_t *)NULL) + DNS_MAXTTL)) {
+			*expires = 0;
+		}
+
+		while((n < max) && fgets(buf, sizeof(buf), fp)) {
+			if(sscanf(buf, "%d %45s", &family, addr) != 2) {
+				continue;
+			}
+#ifdef INET6
+			if((family != AF_INET) && (family != AF_INET6)) {
+#else
+			if(family != AF_INET) {
+#endif
+				continue;
+			}
+			if(inet_pton(family, addr, raw) == 1) {
+				hub_addr_set(&addrs[n++], family, raw, port);
+			}
+		}
+	}
+	(void)fclose(fp);
+
+	return(n);
+}
+
+/*
+hub_cache_save() -- Cache n addresses in path for ttl seconds
+*/
+void hub_cache_save(char *path, struct hub_addr *addrs, int n,
+	unsigned long ttl)
+{
+	char buf[(BUF_SZ + 1)], addr[INET6_ADDRSTRLEN];
+	int i, len;
+	void *raw;
+
+	len = snprintf(buf, sizeof(buf), "%ld\n",
+		(long)(time((time_t *)NULL) + ttl));
+
+	for(i = 0; i < n; i++) {
+		raw = &((struct sockaddr_in *)&addrs[i].sa)->sin_addr;
+#ifdef INET6
+		if(addrs[i].sa.ss_family == AF_INET6) {
+			raw = &((struct sockaddr_in6 *)&addrs[i].sa)->sin6_addr;
+		}
+#endif
+		if(inet_ntop(addrs[i].sa.ss_family, raw, addr, sizeof(addr)) == NULL) {
+			continue;
+		}
+
+		len += snprintf((buf + len), (sizeof(buf) - len), "%d %s\n",
+			addrs[i].sa.ss_family, addr);
+		if(len >= sizeof(buf)) {
+			return;
+		}
+	}
+
+	cache_write(path, buf, len);
+}
+
+/*
+hub_resolve() -- Find the addresses of host:port
+	With a CacheDir, they are looked up in DNS only when the cached ones
+	have outlived their TTL, and the cached ones are still used if that
+	lookup fails.  Returns how many were put in addrs
+*/
+int hub_resolve(char *host, int port, struct hub_addr *addrs, int max)
+{
+	struct hub_addr found[MAXADDRS];
+	unsigned char raw[sizeof(struct in6_addr)];
+	char path[(MAXPATHLEN + 1)];
+	unsigned long ttl = DNS_MAXTTL;
+	time_t expires = 0;
+	int n, stale;
+
+	/* Nothing to look up for an address */
+	if((inet_pton(AF_INET, host, raw) == 1)
+#ifdef INET6
+		|| (inet_pton(AF_INET6, host, raw) == 1)
+#endif
+		|| (cache_path(path, "hub", host, port) == False)) {
+		return(hub_lookup(host, port, addrs, max));
+	}
+
+	stale = hub_cache_load(path, port, addrs, max, &expires);
+	if((stale > 0) && (expires > time((time_t *)NULL))) {
+		return(stale);
+	}
+
+	if(max > MAXADDRS) {
+		max = MAXADDRS;
+	}
+
+	n = 0;
+#ifdef HAVE_RES_SEARCH
+#ifdef INET6
+	if(p_family != PF_INET) {
+		n = dns_query(host, port, T_AAAA, found, n, max, &ttl);
+	}
+	if(p_family != PF_INET6) {
+		n = dns_query(host, port, T_A, found, n, max, &ttl);
+	}
+#else
+	n = dns_query(host, port, T_A, found, n, max, &ttl);
+#endif
+#endif
+
+	/* Not in DNS, but maybe in /etc/hosts */
+	if(n == 0) {
+		n = hub_lookup(host, port, found, max);
+		ttl = DNS_TTL;
+	}
+
+	if(n == 0) {
+		if(stale > 0) {
+			log_event(LOG_INFO,
+				"Unable to locate %s, using its last known addresses", host);
+		}
+		return(stale);
+	}
+
+	hub_cache_save(path, found, n, ttl);
+	(void)memcpy(addrs, found, (n * sizeof(*addrs)));
+
+	return(n);
+}
+
+#ifdef CONNECT_TIMEOUT
+/*
+hub_connect_start() -- Start connecting to the mailhub at a
+	Returns the socket, or -1 if it failed straight away
+*/
+int hub_connect_start(struct hub_addr *a)
+{
+	int s, fd_flags;
+
+	/* Create a socket for the connection */
+	if((s = socket(a->sa.ss_family, SOCK_STREAM, 0)) == -1) {
+		log_event(LOG_ERR, "Unable to create a socket");
+		return(-1);
+	}
+
+	fd_flags = fcntl(s, F_GETFL, 0);
+	if(fcntl(s, F_SETFL, fd_flags | O_NONBLOCK) != 0) {
+		log_event(LOG_ERR, "fcntl(, O_NONBLOCK) failed");
+		(void)close(s);
+		return(-1);
+	}
+
+	while(connect(s, (struct sockaddr *)&a->sa, a->len) == -1) {
+		switch(errno) {
+			case EINPROGRESS:
+				return(s);
+
+			case EINTR:
+				continue;
+		}
+
+		(void)close(s);
+		return(-1);
+	}
+
+	return(s);
+}
+
+/*
+hub_connect() -- Connect to whichever of the n addresses in addrs
+	answers first
+	As in RFC 8305, the families take turns, and a new attempt starts
+	every CONNECT_DELAY msec or as soon as one fails, while the earlier
+	ones are still given up to connect_timeout.  Returns the socket, or -1
+*/
+int hub_connect(struct hub_addr *addrs, int n)
+{
+	struct pollfd fds[MAXADDRS];
+	long started[MAXADDRS], now, last = 0, wait;
+	int order[MAXADDRS];
+	int i, j, k, err, next = 0, pending = 0;
+	socklen_t len;
+
+	if(n > MAXADDRS) {
+		n = MAXADDRS;
+	}
+
+	/* Alternate between the family of the first address and the other */
+	for(i = 0, j = 0, k = 0; k < n; ) {
+		while((i < n) && (addrs[i].sa.ss_family != addrs[0].sa.ss_family)) {
+			i++;
+		}
+		if(i < n) {
+			order[k++] = i++;
+		}
+
+		while((j < n) && (addrs[j].sa.ss_family == addrs[0].sa.ss_family)) {
+			j++;
+		}
+		if(j < n) {
+			order[k++] = j++;
+		}
+	}
+
+	now = msec();
+	for(;;) {
+		/* Nothing to wait for, or the next attempt is due */
+		if((next < n) && ((pending == 0) || (now >= (last + CONNECT_DELAY)))) {
+			if((fds[pending].fd = hub_connect_start(&addrs[order[next++]])) != -1) {
+				fds[pending].events = POLLOUT;
+				started[pending++] = now;
+				last = now;
+			}
+			continue;
+		}
+
+		if(pending == 0) {
+			return(-1);
+		}
+
+		/* Until one is done, the oldest times out or the next is due */
+		wait = (started[0] + connect_timeout) - now;
+		if((next < n) && (((last + CONNECT_DELAY) - now) < wait)) {
+			wait = (last + CONNECT_DELAY) - now;
+		}
+
+		if(ev_poll(fds, pending, ((wait > 0) ? wait : 0)) == -1) {
+			break;
+		}
+		now = msec();
+
+		for(i = 0; i < pending; ) {
+			if(fds[i].revents) {
+				len = sizeof(err);
+				if((getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0)
+					&& (err == 0)) {
+					/* We have a winner */
+					for(j = 0; j < pending; j++) {
+						if(j != i) {
+							(void)close(fds[j].fd);
+						}
+					}
+
+					return(fds[i].fd);
+				}
+
+				/* Don't hold the next one back for a failure */
+				last = (now - CONNECT_DELAY);
+			}
+			else if((now - started[i]) < connect_timeout) {
+				i++;
+				continue;
+			}
+
+			(void)close(fds[i].fd);
+			pending--;
+			for(j = i; j < pending; j++) {
+				fds[j] = fds[(j + 1)];
+				started[j] = started[(j + 1)];
+			}
+		}
+	}
+
+	for(i = 0; i < pending; i++) {
+		(void)close(fds[i].fd);
+	}
+
+	return(-1);
+}
+#else
+/*
+hub_connect() -- Connect to the first of the n addresses in addrs that
+	will have us
+	Returns the socket, or -1
+*/
+int hub_connect(struct hub_addr *addrs, int n)
+{
+	int i, s;
+
+	for(i = 0; i < n; i++) {
+		/* Create a socket for the connection */
+		if((s = socket(addrs[i].sa.ss_family, SOCK_STREAM, 0)) == -1) {
+			log_event(LOG_ERR, "Unable to create a socket");
+			continue;
+		}
+
+		if(connect(s, (struct sockaddr *)&addrs[i].sa, addrs[i].len) == 0) {
+			return(s);
+		}
+		(void)close(s);
+	}
+
+	return(-1);
+}
+#endif
+
+/*
+hub_list() -- Split a MailHub setting, host[:port][/weight] separated by
+	commas, into hubs; spec is cut up in the process
+	Hubs after a semicolon are only used when those before it fail.
+	Returns how many hubs there are
+*/
+int hub_list(char *spec, int port, struct hub *hubs, int max)
+{
+	char *p, *q, end;
+	int n = 0, pref = 0;
+	size_t len;
+
+	for(p = spec; (n < max); p += (len + 1)) {
+		len = strcspn(p, ",; \t");
+		end = p[len];
+		p[len] = '\0';
+
+		if(len) {
+			(void)memset(&hubs[n], 0, sizeof(hubs[n]));
+			hubs[n].host = p;
+			hubs[n].port = port;
+			hubs[n].weight = 1;
+			hubs[n].pref = pref;
+
+			if((q = strchr(p, '/'))) {
+				*q++ = '\0';
+				if((hubs[n].weight = atoi(q)) < 1) {
+					hubs[n].weight = 1;
+				}
+			}
+
+			if((q = strchr(p, ':'))) {
+				*q++ = '\0';
+				hubs[n].port = atoi(q);
+			}
+			n++;
+		}
+
+		if(end == ';') {
+			pref++;
+		}
+		else if(end == '\0') {
+			break;
+		}
+	}
+
+	return(n);
+}
+
+/*
+hub_health_load() -- Fill in what the health file knows about hubs
+*/
+void hub_health_load(struct hub *hubs, int n)
+{
+	char buf[(BUF_SZ + 1)], path[(MAXPATHLEN + 1)], name[(BUF_SZ + 1)];
+	long failed, latency;
+	int fd, i, failures;
+	FILE *fp;
+
+	if((cache_path(path, "health", (char *)NULL, 0) == False)
+		|| ((fd = cache_open(path)) == -1)) {
+		return;
+	}
+
+	if((fp = fdopen(fd, "r")) == (FILE *)NULL) {
+		(void)close(fd);
+		return;
+	}
+
+	while(fgets(buf, sizeof(buf), fp)) {
+		if(sscanf(buf, "%s %d %ld %ld", name, &failures, &failed, &latency) != 4) {
+			continue;
+		}
+
+		for(i = 0; i < n; i++) {
+			(void)snprintf(buf, sizeof(buf), "%s:%d", hubs[i].host, hubs[i].port);
+			if(strcmp(buf, name) == 0) {
+				hubs[i].failures = failures;
+				hubs[i].failed = (time_t)failed;
+				hubs[i].latency = latency;
+			}
+		}
+	}
+	(void)fclose(fp);
+}
+
+/*
+hub_health_save() -- Record in the health file how connecting to hub went
+	What it says about other hubs is kept; if another run writes it at
+	the same time, one of the updates is lost, which does no harm
+*/
+void hub_health_save(struct hub *hub)
+{
+	char buf[(BUF_SZ + 1)], path[(MAXPATHLEN + 1)], name[(BUF_SZ + 1)];
+	char out[(BUF_SZ * 4)];
+	int fd, len, line;
+	FILE *fp;
+
+	if(cache_path(path, "health", (char *)NULL, 0) == False) {
+		return;
+	}
+	(void)snprintf(name, sizeof(name), "%s:%d", hub->host, hub->port);
+
+	len = snprintf(out, sizeof(out), "%s %d %ld %ld\n",
+		name, hub->failures, (long)hub->failed, hub->latency);
+
+	if((fd = cache_open(path)) != -1) {
+		if((fp = fdopen(fd, "r")) == (FILE *)NULL) {
+			(void)close(fd);
+			return;
+		}
+
+		while(fgets(buf, sizeof(buf), fp)) {
+			line = strlen(buf);
+
+			if((strncmp(buf, name, strlen(name)) == 0)
+				&& (buf[strlen(name)] == ' ')) {
+				continue;
+			}
+
+			/* Keep the file small, let hubs we don't hear of drop off */
+			if((len + line) >= sizeof(out)) {
+				break;
+			}
+			(void)memcpy((out + len), buf, line);
+			len += line;
+		}
+		(void)fclose(fp);
+	}
+
+	cache_write(path, out, len);
+}
+
+/*
+hub_weight() -- How likely hub is to be tried first
+	Its weight, cut down for hubs slower than HUB_SLOW msec to connect to
+*/
+long hub_weight(struct hub *hub)
+{
+	long w = (hub->weight * 1000L);
+
+	if(hub->latency > HUB_SLOW) {
+		w = ((w * HUB_SLOW) / hub->latency);
+	}
+
+	return((w > 0) ? w : 1);
+}
+
+/*
+hub_order() -- Put hubs in the order to try them
+	The ones that failed in the last HUB_HOLDDOWN seconds go last, the
+	one that failed longest ago first.  The rest go by preference, and
+	those that share one are shuffled, with each as likely to come first
+	as its hub_weight() says
+*/
+void hub_order(struct hub *hubs, int n)
+{
+	static bool_t seeded = False;
+	long w[MAXHUBS], total, r;
+	time_t now = time((time_t *)NULL);
+	struct hub tmp;
+	int i, j, last, up = 0;
+
+	if(seeded == False) {
+		srandom((unsigned int)(now ^ getpid()));
+		seeded = True;
+	}
+
+	for(i = 0; i < n; i++) {
+		if((hubs[i].failures == 0) || ((hubs[i].failed + HUB_HOLDDOWN) <= now)) {
+			tmp = hubs[up];
+			hubs[up++] = hubs[i];
+			hubs[i] = tmp;
+		}
+	}
+
+	for(i = 1; i < n; i++) {
+		for(j = i; (j > 0) && (j != up); j--) {
+			if((j < up) ? (hubs[(j - 1)].pref <= hubs[j].pref)
+				: (hubs[(j - 1)].failed <= hubs[j].failed)) {
+				break;
+			}
+			tmp = hubs[j];
+			hubs[j] = hubs[(j - 1)];
+			hubs[(j - 1)] = tmp;
+		}
+	}
+
+	for(i = 0; i < up; i++) {
+		for(last = i, total = 0;
+			(last < up) && (hubs[last].pref == hubs[i].pref); last++) {
+			total += (w[last] = hub_weight(&hubs[last]));
+		}
+
+		for(j = i, r = (random() % total); r >= w[j]; j++) {
+			r -= w[j];
+		}
+
+		tmp = hubs[i];
+		hubs[i] = hubs[j];
+		hubs[j] = tmp;
+	}
+}
+
+/*
+hub_open() -- Connect to a single mailhub
+*/
+int hub_open(char *host, int port)
+{
+	struct hub_addr addrs[MAXADDRS];
+	int n, s;
+
+	/* Check we can reach the host */
+	if((n = hub_resolve(host, port, addrs, MAXADDRS)) == 0) {
+		log_event(LOG_ERR, "Unable to locate %s", host);
+		return(-1);
+	}
+
+	if((s = hub_connect(addrs, n)) == -1) {
+		log_event(LOG_ERR, "Unable to connect to %s:%d", host, port);
+		return(-1);
+	}
+
+	return(s);
+}
+
+/*
+hub_ours() -- Is host the mailhub, rather than an MX host or a Route
+	mailhub?  Only the mailhub is given AuthUser and TLSCert
+*/
+bool_t hub_ours(char *host)
+{
+	return((strcasecmp(host, mailhost) == 0) ? True : False);
+}
+
+/*
+smtp_starttls() -- Does TLS with host start in plain text, with STARTTLS?
+	MX hosts only listen on port 25, so that is the only way to them
+*/
+bool_t smtp_starttls(char *host)
+{
+	return((use_starttls || (use_tls && (*host == '@'))) ? True : False);
+}
+
+/*
+smtp_open() -- Open connection to a remote SMTP listener
+	host may list several mailhubs, see hub_list(); with more than one,
+	they are tried in the order hub_order() picks, and how each attempt
+	went is remembered for the next run
+*/
+int smtp_open(char *host, int port)
+{
+	char spec[(BUF_SZ + 1)];
+	struct hub hubs[MAXHUBS];
+	struct smtp_conn *c;
+	long start;
+	int i, n, s = -1;
+
+#ifdef HAVE_SSL
+	bool_t starttls = smtp_starttls(host);
+	char buf[(BUF_SZ + 1)];
+
+	SSL_CTX *ctx = (SSL_CTX *)NULL;
+	X509 *server_cert;
+
+	/* Before connecting, so a bad certificate costs no connection */
+	if((use_tls == True) && ((ctx = tls_ctx(hub_ours(host))) == (SSL_CTX *)NULL)) {
+		return(-1);
+	}
+#endif
+
+	dns_init();
+
+	/* "@domain" stands for the MX hosts of domain */
+	if(*host == '@') {
+		switch(mx_list((host + 1), spec, sizeof(spec))) {
+			case 0:
+				log_event(LOG_ERR, "%s does not accept mail", (host + 1));
+				return(-1);
+
+			case -1:
+				log_event(LOG_ERR, "Cannot find the MX hosts of %s",
+					(host + 1));
+				return(-1);
+		}
+	}
+	else {
+		(void)strncpy(spec, host, BUF_SZ);
+		spec[BUF_SZ] = '\0';
+	}
+
+	if((n = hub_list(spec, port, hubs, MAXHUBS)) > 1) {
+		hub_health_load(hubs, n);
+		hub_order(hubs, n);
+	}
+
+	for(i = 0; (i < n) && (s == -1); i++) {
+		start = msec();
+		s = hub_open(hubs[i].host, hubs[i].port);
+
+		if(n > 1) {
+			if(s == -1) {
+				hubs[i].failures++;
+				hubs[i].failed = time((time_t *)NULL);
+			}
+			else {
+				hubs[i].failures = 0;
+				start = (msec() - start);
+				hubs[i].latency = hubs[i].latency
+					? (((hubs[i].latency * 3) + start) / 4) : start;
+			}
+			hub_health_save(&hubs[i]);
+		}
+	}
+
+	if(s == -1) {
+		return(-1);
+	}
+
+	/* From here on, it's the mailhub we got through to */
+	host = hubs[(i - 1)].host;
+	port = hubs[(i - 1)].port;
+
+	c = smtp_conn_new(s);
+	if((c->host = strdup(host)) == (char *)NULL) {
+		die("smtp_open() -- strdup() failed");
+	}
+	c->port = port;
+
+#ifdef HAVE_SSL
+	if(use_tls == True) {
+		log_event(LOG_INFO, "Creating SSL connection to host");
+
+		if (starttls == True)
+		{
+			/* c->tls is still False, so this is plain text */
+			if (smtp_okay(s, buf))
+			{
+				if (smtp_ehlo(s, buf)) {
+					smtp_write(s, "STARTTLS"); /* assume STARTTLS regardless */
+					if (!smtp_okay(s, buf)) {
+						log_event(LOG_ERR, "STARTTLS not working");
+						smtp_close(s);
+						return(-1);
+					}
+					/* Anything buffered past the STARTTLS reply was
+					   sent in the clear; don't let it leak into TLS */
+					c->rbuf_pos = c->rbuf_len = 0;
+				}
+				else
+				{
+					log_event(LOG_ERR, "Invalid response: %s (%s)", buf, hostname);
+				}
+			}
+			else
+			{
+				log_event(LOG_ERR, "Invalid response SMTP Server (STARTTLS)");
+				smtp_close(s);
+				return(-1);
+			}
+		}
+
+		c->ssl = SSL_new(ctx);
+		if(!c->ssl) {
+			log_event(LOG_ERR, "SSL not working");
+			smtp_close(s);
+			return(-1);
+		}
+		SSL_set_fd(c->ssl, s);
+		tls_session_load(c->ssl, host, port);
+
+		if(tls_connect(s) == -1) {
+			log_event(LOG_ERR, "TLS handshake with %s failed", host);
+			smtp_close(s);
+			return(-1);
+		}
+		c->tls = True;
+
+		if(SSL_session_reused(c->ssl) && (log_level > 0)) {
+			log_event(LOG_INFO, "Resumed TLS session with %s", host);
+		}
+
+		if(log_level > 0 || 1) {
+			log_event(LOG_INFO, "SSL connection using %s",
+				SSL_get_cipher(c->ssl));
+		}
+
+		server_cert = SSL_get_peer_certificate(c->ssl);
+		if(!server_cert) {
+			smtp_close(s);
+			return(-1);
+		}
+		X509_free(server_cert);
+
+		/* TODO: Check server cert if changed! */
+	}
+#endif
+
+	return(s);
+}
+
+/*
+fd_read() -- Read whatever is available from an fd, up to count bytes
+*/
+ssize_t fd_read(int fd, void *buf, size_t count)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+#ifdef READ_TIMEOUT
+	int read_bytes;
+#endif
+
+#ifdef HAVE_SSL
+	if(c->tls == True) { 
+		return(tls_read(fd, buf, count));
+	}
+#endif
+#ifdef READ_TIMEOUT
+	while (1) {
+		read_bytes = read(fd, buf, count);
+
+		if (read_bytes == -1) {
+			switch (errno) {
+				case EAGAIN:
+					{
+						int res;
+
+						/* Up to the end of the reply, see smtp_read() */
+						res = ssmtp_poll(fd, POLLIN, ev_left(c->deadline));
+						if (res == SSMTP_POLL_SUCCESS) {
+							continue;
+						}
+						log_event(LOG_ERR, "read() timed out");
+						return -1;
+					}
+				default:
+					log_event(LOG_ERR, "poll() failed on read");
+					return -1;
+			}
+		} else {
+			return read_bytes;
+		}
+	}
+#else
+	return(read(fd, buf, count));
+#endif
+}
+
+/*
+fd_gets() -- Get a line from a fd instead of an fp
+	Lines are cut out of the rbuf of fd, which is refilled RBUF_SZ bytes at a time
+*/
+char *fd_gets(char *buf, int size, int fd)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+	char *p, *nl;
+	ssize_t n;
+	int i = 0;
+
+	while(i < size) {
+		if(c->rbuf_pos == c->rbuf_len) {
+			if((n = fd_read(fd, c->rbuf, sizeof(c->rbuf))) <= 0) {
+				if(i == 0) {
+					buf[0] = '\0';
+					return(NULL);
+				}
+				break;
+			}
+			c->rbuf_pos = 0;
+			c->rbuf_len = n;
+		}
+
+		p = (c->rbuf + c->rbuf_pos);
+		n = (c->rbuf_len - c->rbuf_pos);
+		if((nl = memchr(p, '\n', n))) {
+			n = (nl - p);
+		}
+		if(n > (size - i)) {
+			n = (size - i);
+			nl = NULL;
+		}
+		c->rbuf_pos += n;
+
+		while(n--) {
+			if(*p != '\r') {	/* Strip <CR> */
+				buf[i++] = *p;
+			}
+			p++;
+		}
+
+		if(nl) {
+			c->rbuf_pos++;		/* Swallow the <LF> */
+			break;
+		}
+	}
+	buf[i] = '\0';
+
+	return(buf);
+}
+
+/*
+smtp_read() -- Get a line and return the initial digit
+*/
+int smtp_read(int fd, char *response)
+{
+	/* Whatever we have queued must reach the server before it can reply */
+	(void)fd_flush(fd);
+
+	/* All of the reply has to be in by then */
+	smtp_conn(fd)->deadline = (msec() + read_timeout);
+
+	do {
+		if(fd_gets(response, BUF_SZ, fd) == NULL) {
+			/* A late reply would only put us out of step, so that's it */
+			(void)shutdown(fd, SHUT_RD);
+
+			(void)strcpy(response, "Lost connection to the mailhub");
+			return(0);
+		}
+	}
+	while(response[3] == '-');
+
+	if(log_level > 0) {
+		log_event(LOG_INFO, "%s\n", response);
+	}
+
+	if(minus_v) {
+		(void)fprintf(stderr, "[<-] %s\n", response);
+	}
+
+	return(atoi(response) / 100);
+}
+
+/*
+smtp_okay() -- Get a line and test the three-number string at the beginning
+				If it starts with a 2, it's OK
+*/
+int smtp_okay(int fd, char *response)
+{
+	return((smtp_read(fd, response) == 2) ? 1 : 0);
+}
+
+/*
+esmtp_reset() -- Forget everything learnt from a previous EHLO
+*/
+void esmtp_reset(int fd)
+{
+	struct esmtp_ext *e;
+
+	for(e = smtp_conn(fd)->ext; e->keyword; e++) {
+		e->offered = False;
+		if(e->params) {
+			free(e->params);
+			e->params = (char *)NULL;
+		}
+	}
+}
+
+/*
+esmtp_parse() -- Note the extension announced by one line of an EHLO reply
+	The line is "keyword [params]"; the old "AUTH=params" form is accepted
+*/
+void esmtp_parse(int fd, char *str)
+{
+	struct esmtp_ext *e;
+	size_t len;
+	char *p;
+
+	len = strcspn(str, " =");
+	p = strip_pre_ws(str + len + ((str[len] == '=') ? 1 : 0));
+
+	for(e = smtp_conn(fd)->ext; e->keyword; e++) {
+		if((strlen(e->keyword) == len)
+			&& (strncasecmp(e->keyword, str, len) == 0)) {
+			e->offered = True;
+
+			if(e->params == (char *)NULL) {
+				if((e->params = strdup(p)) == (char *)NULL) {
+					die("esmtp_parse() -- strdup() failed");
+				}
+			}
+			return;
+		}
+	}
+}
+
+/*
+esmtp_auth() -- Was the given SASL mechanism in the AUTH line?
+*/
+bool_t esmtp_auth(int fd, char *mech)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+	size_t len = strlen(mech);
+	char *p;
+
+	if(c->ext[EXT_AUTH].offered == False) {
+		return(False);
+	}
+
+	for(p = c->ext[EXT_AUTH].params; *p; p += strcspn(p, " ")) {
+		p = strip_pre_ws(p);
+
+		if((strncasecmp(p, mech, len) == 0)
+			&& ((p[len] == '\0') || isspace(p[len]))) {
+			return(True);
+		}
+	}
+
+	return(False);
+}
+
+/*
+smtp_ehlo() -- Send EHLO and record the extensions in the reply
+*/
+int smtp_ehlo(int fd, char *response)
+{
+	bool_t first = True;
+
+	esmtp_reset(fd);
+
+	smtp_write(fd, "EHLO %s", hostname);
+	(void)fd_flush(fd);
+	smtp_conn(fd)->deadline = (msec() + read_timeout);
+
+	do {
+		if(fd_gets(response, BUF_SZ, fd) == NULL) {
+			return(0);
+		}
+
+		if(minus_v) {
+			(void)fprintf(stderr, "[<-] %s\n", response);
+		}
+
+		/* The first line only carries the server's greeting */
+		if((first == False) && (strncmp(response, "250", 3) == 0)) {
+			esmtp_parse(fd, (response + 4));
+		}
+		first = False;
+	}
+	while(response[3] == '-');
+
+	if(log_level > 0) {
+		log_event(LOG_INFO, "%s\n", response);
+	}
+
+	return((atoi(response) / 100 == 2) ? 1 : 0);
+}
+
+/*
+smtp_fail() -- Put the reason a transaction failed in response
+	Always returns -1, so it can be returned straight away
+*/
+int smtp_fail(char *response, char *format, ...)
+{
+	char buf[(BUF_SZ + 1)];
+	va_list ap;
+
+	va_start(ap, format);
+	(void)vsnprintf(buf, BUF_SZ, format, ap);
+	va_end(ap);
+
+	(void)strcpy(response, buf);
+
+	return(-1);
+}
+
+/*
+smtp_sync() -- Read the replies to all outstanding commands
+	Each of them has to be a 2xx, otherwise the transaction is over;
+	all replies are read regardless, and the first failure is returned
+*/
+int smtp_sync(int fd, char *response)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+	char failure[(BUF_SZ + 1)];
+	int res = 0;
+
+	while(c->pipelined > 0) {
+		c->pipelined--;
+
+		if((smtp_okay(fd, response) == 0) && (res == 0)) {
+			(void)strcpy(failure, response);
+			res = -1;
+		}
+	}
+
+	if(res == -1) {
+		(void)strcpy(response, failure);
+	}
+
+	return(res);
+}
+
+/*
+smtp_pipeline() -- Account for a command that has to succeed
+	Without PIPELINING the reply is checked right away, with it the
+	reply is left for smtp_sync() unless MAXPIPELINE are outstanding
+*/
+int smtp_pipeline(int fd, char *response)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+
+	c->pipelined++;
+
+	if((c->ext[EXT_PIPELINING].offered == False)
+		|| (c->pipelined >= MAXPIPELINE)) {
+		return(smtp_sync(fd, response));
+	}
+
+	return(0);
+}
+
+/*
+fd_puts() -- Write characters to fd
+*/
+ssize_t fd_puts(int fd, const void *buf, size_t count) 
+{
+#ifdef WRITE_TIMEOUT
+	int written_bytes, written_bytes_total = 0;
+#else
+	int fd_flags, ret;
+#endif
+
+#ifdef HAVE_SSL
+	if(smtp_conn(fd)->tls == True) { 
+		return(tls_write(fd, buf, count));
+	}
+#endif
+#ifdef WRITE_TIMEOUT
+	while (count > 0) {
+		written_bytes = write(fd, buf + written_bytes_total, count);
+
+		if (written_bytes < 0) {
+			switch (errno) {
+				case EAGAIN:
+					{
+						int res;
+
+						res = ssmtp_poll(fd, POLLOUT, write_timeout);
+						if (res == SSMTP_POLL_SUCCESS) {
+							continue;
+						}
+						return -1;
+					}
+				default:
+					return -1;
+			}
+
+		} else {
+			written_bytes_total += written_bytes;
+			count -= written_bytes;
+		}
+	}
+	return written_bytes_total;
+#else
+	fd_flags = fcntl(fd, F_GETFL, 0);
+	if (fcntl(fd, F_SETFL, fd_flags &~ O_NONBLOCK) != 0) {
+		log_event(LOG_ERR, "fcntl(, ) failed");
+		return(-1);
+	}
+
+	ret = write(fd, buf, count);
+
+	if (fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK) != 0) {
+		log_event(LOG_ERR, "fcntl(, ) failed");
+		return(-1);
+	}
+	return ret;
+#endif
+}
+
+/*
+fd_flush() -- Write out everything queued by smtp_write()
+*/
+ssize_t fd_flush(int fd)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+	ssize_t ret = 0;
+
+	if(c->wbuf_len > 0) {
+		ret = fd_puts(fd, c->wbuf, c->wbuf_len);
+		c->wbuf_len = 0;
+	}
+
+	return(ret);
+}
+
+/*
+smtp_write() -- A printf to an fd and append <CR/LF>
+	The line is only queued; it goes out with the next fd_flush()
+*/
+void smtp_write(int fd, char *format, ...)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+	char *buf;
+	va_list ap;
+	int len;
+
+	/* Make sure a maximum length line still fits */
+	if((sizeof(c->wbuf) - c->wbuf_len) < (BUF_SZ + 1)) {
+		(void)fd_flush(fd);
+	}
+	buf = (c->wbuf + c->wbuf_len);
+
+	va_start(ap, format);
+	if((len = vsnprintf(buf, (BUF_SZ - 2), format, ap)) == -1) {
+		die("smtp_write() -- vsnprintf() failed");
+	}
+	va_end(ap);
+
+	if(len > (BUF_SZ - 3)) {
+		len = (BUF_SZ - 3);
+	}
+
+	if(log_level > 0) {
+		log_event(LOG_INFO, "%s\n", buf);
+	}
+
+	if(minus_v) {
+		(void)fprintf(stderr, "[->] %s\n", buf);
+	}
+	(void)memcpy((buf + len), "\r\n", 2);
+
+	c->wbuf_len += (len + 2);
+}
+
+/*
+chunk_buf() -- The buffer BDAT chunks are collected in, made on first use
+*/
+char *chunk_buf(struct smtp_conn *c)
+{
+	if(c->cbuf == (char *)NULL) {
+		if((c->cbuf = (char *)malloc(CHUNK_SZ)) == (char *)NULL) {
+			die("chunk_buf() -- malloc() failed");
+		}
+	}
+
+	return(c->cbuf);
+}
+
+/*
+bdat_send() -- Send what has been collected in cbuf as one BDAT chunk
+	The reply to the LAST chunk is left for the caller to read
+*/
+int bdat_send(int fd, char *response, bool_t last)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+
+	smtp_write(fd, "BDAT %lu%s", (unsigned long)c->cbuf_len, last ? " LAST" : "");
+
+	/* A chunk cut short would have the mailhub read our next command
+	   as message text */
+	if((fd_flush(fd) == -1)
+		|| (fd_puts(fd, c->cbuf, c->cbuf_len) != (ssize_t)c->cbuf_len)) {
+		c->cbuf_len = 0;
+		return(smtp_fail(response, "Cannot send message body"));
+	}
+	c->cbuf_len = 0;
+
+	if(last == False) {
+		return(smtp_pipeline(fd, response));
+	}
+
+	return(0);
+}
+
+/*
+msg_write() -- Add raw message text to the current BDAT chunk, to
+	the DATA text queued in wbuf or, while a message is being queued,
+	to its spool file
+*/
+int msg_write(int fd, char *response, const char *buf, size_t count)
+{
+	struct smtp_conn *c;
+	size_t n, *len, size;
+	char *dst;
+
+	/* Write errors stick to the stream and are caught by spool_write() */
+	if(spool_fp) {
+		(void)fwrite(buf, 1, count, spool_fp);
+		return(0);
+	}
+	c = smtp_conn(fd);
+
+	while(count > 0) {
+		if(c->use_bdat) {
+			if((c->cbuf_len == CHUNK_SZ)
+				&& (bdat_send(fd, response, False) == -1)) {
+				return(-1);
+			}
+			dst = chunk_buf(c);
+			len = &c->cbuf_len;
+			size = CHUNK_SZ;
+		}
+		else {
+			if((c->wbuf_len == WBUF_SZ) && (fd_flush(fd) == -1)) {
+				return(smtp_fail(response, "Cannot send message body"));
+			}
+			dst = c->wbuf;
+			len = &c->wbuf_len;
+			size = WBUF_SZ;
+		}
+
+		n = (size - *len);
+		if(n > count) {
+			n = count;
+		}
+		(void)memcpy((dst + *len), buf, n);
+
+		*len += n;
+		buf += n;
+		count -= n;
+	}
+
+	return(0);
+}
+
+/*
+msg_body() -- Copy the rest of the message to msg_write() in blocks
+	Bare <LF>s become <CR/LF>s and, for DATA, lines that begin with a
+	dot get another one; lines may be of any length and span blocks.
+	scan_body() finds where that is needed, and text in between goes
+	out as it is
+*/
+int msg_body(int fd, char *response, FILE *stream, bool_t stuff)
+{
+	char buf[RBUF_SZ], *p, *q, *nl, *end;
+	char last = '\n';
+	size_t n;
+
+	while((n = fread(buf, 1, sizeof(buf), stream)) > 0) {
+		end = (buf + n);
+
+		/* The first line, or one the last block ended just before */
+		if(stuff && (last == '\n') && (buf[0] == '.')
+			&& (msg_write(fd, response, ".", 1) == -1)) {
+			return(-1);
+		}
+
+		for(p = q = buf; (nl = scan_body(q, end, ((q > buf) ? *(q - 1) : last),
+			stuff)); q = (nl + 1)) {
+			if(((nl > buf) ? *(nl - 1) : last) != '\r') {
+				if((msg_write(fd, response, p, (nl - p)) == -1)
+					|| (msg_write(fd, response, "\r", 1) == -1)) {
+					return(-1);
+				}
+				p = nl;
+			}
+
+			if(stuff && ((nl + 1) < end) && (*(nl + 1) == '.')) {
+				if((msg_write(fd, response, p, ((nl + 1) - p)) == -1)
+					|| (msg_write(fd, response, ".", 1) == -1)) {
+					return(-1);
+				}
+				p = (nl + 1);
+			}
+		}
+
+		if(msg_write(fd, response, p, (end - p)) == -1) {
+			return(-1);
+		}
+
+		last = *(end - 1);
+	}
+
+	/* The message has to end with a line break */
+	if(last != '\n') {
+		return(msg_write(fd, response, "\r\n", 2));
+	}
+
+	return(0);
+}
+
+/*
+fd_move() -- Move count bytes of in_fd to the mailhub without copying
+	Returns the number of bytes moved, which is short only at EOF
+*/
+ssize_t fd_move(int fd, int in_fd, int kind, size_t count)
+{
+	size_t total = 0;
+	ssize_t n;
+
+	while(total < count) {
+		if((n = zc_move(fd, in_fd, kind, (count - total))) == 0) {
+			break;
+		}
+
+		if(n == -1) {
+			switch(errno) {
+				case EAGAIN:
+					if(ssmtp_poll(fd, POLLOUT, write_timeout)
+						== SSMTP_POLL_SUCCESS) {
+						continue;
+					}
+					log_event(LOG_ERR, "write() timed out");
+					return(-1);
+				case EINTR:
+					continue;
+				default:
+					log_event(LOG_ERR, "Zero-copy transfer failed");
+					return(-1);
+			}
+		}
+		total += n;
+	}
+
+	return(total);
+}
+
+/*
+zc_ahead() -- Send what stdio read from the pipe under stream ahead of
+	where we are, as it is, before the rest is moved past stdio
+	Whatever else the pipe holds right now comes along.  Returns -1
+	on failure
+*/
+int zc_ahead(int fd, char *response, FILE *stream)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+	int in_fd = fileno(stream), flags, res = 0;
+	size_t n;
+
+	/* A short read means stdio has nothing left; don't wait for more */
+	flags = fcntl(in_fd, F_GETFL, 0);
+	(void)fcntl(in_fd, F_SETFL, (flags | O_NONBLOCK));
+
+	do {
+		if((n = fread(chunk_buf(c), 1, CHUNK_SZ, stream)) == 0) {
+			break;
+		}
+
+		if(c->use_bdat) {
+			smtp_write(fd, "BDAT %lu", (unsigned long)n);
+		}
+
+		if((fd_flush(fd) == -1) || (fd_puts(fd, c->cbuf, n) != (ssize_t)n)) {
+			res = smtp_fail(response, "Cannot send message body");
+		}
+		else if(c->use_bdat) {
+			res = smtp_pipeline(fd, response);
+		}
+	} while((res == 0) && (n == CHUNK_SZ));
+
+	(void)fcntl(in_fd, F_SETFL, flags);
+	clearerr(stream);
+
+	return(res);
+}
+
+/*
+zc_body() -- Send the body straight from the fd under stream
+	Only done when format says the text is ready to go out as it is
+	and nothing (like TLS) has to touch it.  Returns 1 if the body
+	was sent, 0 if it has to go the normal way and -1 on failure
+*/
+int zc_body(int fd, char *response, FILE *stream, int format)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+	int in_fd, kind;
+	struct stat st;
+	long deadline;
+	off_t pos = 0;
+	ssize_t n;
+
+	if((format == ZC_OFF) || ((format == ZC_CRLF) && !c->use_bdat)) {
+		return(0);
+	}
+
+	in_fd = fileno(stream);
+	kind = (c->tls == True) ? ZC_NONE : zc_kind(in_fd);
+
+	if(kind == ZC_REGULAR) {
+		/* Step over whatever stdio read ahead of the headers */
+		if(((pos = ftello(stream)) == -1)
+			|| (lseek(in_fd, pos, SEEK_SET) == -1)
+			|| (fstat(in_fd, &st) == -1)) {
+			kind = ZC_NONE;
+		}
+	}
+
+	if(kind == ZC_NONE) {
+		if(format == ZC_CRLF) {
+			return(0);
+		}
+
+		/* Already stuffed text must still not be stuffed twice */
+		(void)fd_flush(fd);
+		while((n = fread(chunk_buf(c), 1, CHUNK_SZ, stream)) > 0) {
+			if(fd_puts(fd, c->cbuf, n) != n) {
+				return(smtp_fail(response, "Cannot send message body"));
+			}
+		}
+		smtp_write(fd, ".");
+
+		return(1);
+	}
+
+	if(c->use_bdat == False) {
+		(void)fd_flush(fd);
+
+		if(kind == ZC_REGULAR) {
+			/* A file cut short under us must not end in a "." */
+			if(fd_move(fd, in_fd, kind, (st.st_size - pos)) != (st.st_size - pos)) {
+				return(smtp_fail(response, "Cannot send message body"));
+			}
+		}
+		else if(zc_ahead(fd, response, stream) == -1) {
+			return(-1);
+		}
+		else {
+			/* Move only what is in the pipe, so a stalled writer
+			   costs no more than BODYWAIT, as with BDAT below */
+			deadline = (msec() + (BODYWAIT * 1000));
+			while((n = zc_avail(in_fd, ev_left(deadline))) > 0) {
+				if(fd_move(fd, in_fd, kind, n) != n) {
+					return(smtp_fail(response, "Cannot send message body"));
+				}
+				deadline = (msec() + (BODYWAIT * 1000));
+			}
+
+			if(n == -1) {
+				return(smtp_fail(response, "Cannot read message body: %s",
+					strerror(errno)));
+			}
+		}
+		smtp_write(fd, ".");
+
+		return(1);
+	}
+
+	/* The headers go out as a chunk of their own */
+	if((c->cbuf_len > 0) && (bdat_send(fd, response, False) == -1)) {
+		return(-1);
+	}
+
+	if(kind == ZC_REGULAR) {
+		n = (st.st_size - pos);
+
+		smtp_write(fd, "BDAT %lu LAST", (unsigned long)n);
+		(void)fd_flush(fd);
+
+		if(fd_move(fd, in_fd, kind, n) != n) {
+			return(smtp_fail(response, "Cannot send message body"));
+		}
+
+		return(1);
+	}
+
+	if(zc_ahead(fd, response, stream) == -1) {
+		return(-1);
+	}
+
+	/* Only what is sitting in the pipe can be announced in a BDAT.  The
+	   writer may pause, but not for longer than the mailhub waits */
+	deadline = (msec() + (BODYWAIT * 1000));
+	while((n = zc_avail(in_fd, ev_left(deadline))) > 0) {
+		smtp_write(fd, "BDAT %lu", (unsigned long)n);
+		(void)fd_flush(fd);
+
+		if(fd_move(fd, in_fd, kind, n) != n) {
+			return(smtp_fail(response, "Cannot send message body"));
+		}
+
+		if(smtp_pipeline(fd, response) == -1) {
+			return(-1);
+		}
+		deadline = (msec() + (BODYWAIT * 1000));
+	}
+
+	if(n == -1) {
+		return(smtp_fail(response, "Cannot read message body: %s",
+			strerror(errno)));
+	}
+	smtp_write(fd, "BDAT 0 LAST");
+
+	return(1);
+}
+
+/*
+data_write() -- A printf of one line of the message itself
+	The line goes out as DATA text, into the BDAT chunk with CHUNKING
+	or into the spool file while the message is being queued
+*/
+int data_write(int fd, char *response, char *format, ...)
+{
+	char buf[(BUF_SZ + 1)];
+	va_list ap;
+	int len;
+
+	va_start(ap, format);
+	if((len = vsnprintf(buf, (BUF_SZ - 2), format, ap)) == -1) {
+		die("data_write() -- vsnprintf() failed");
+	}
+	va_end(ap);
+
+	if((spool_fp == (FILE *)NULL) && (smtp_conn(fd)->use_bdat == False)) {
+		smtp_write(fd, "%s", buf);
+		return(0);
+	}
+
+	if(len > (BUF_SZ - 3)) {
+		len = (BUF_SZ - 3);
+	}
+
+	if(spool_fp == (FILE *)NULL) {
+		if(log_level > 0) {
+			log_event(LOG_INFO, "%s\n", buf);
+		}
+
+		if(minus_v) {
+			(void)fprintf(stderr, "[->] %s\n", buf);
+		}
+	}
+	(void)memcpy((buf + len), "\r\n", 2);
+
+	return(msg_write(fd, response, buf, (len + 2)));
+}
+
+/*
+header_write() -- Send the headers we add, then the ones we were given
+*/
+int header_write(int fd, char *response)
+{
+	int i, res;
+
+	res = data_write(fd, response,
+		"Received: by %s (sSMTP sendmail emulation); %s", hostname, arpadate);
+
+	if(have_from == False) {
+		res |= data_write(fd, response, "From: %s", from);
+	}
+
+	if(have_date == False) {
+		res |= data_write(fd, response, "Date: %s", arpadate);
+	}
+
+#ifdef HASTO_OPTION
+	if(have_to == False) {
+		res |= data_write(fd, response, "To: postmaster");
+	}
+#endif
+
+	/* Given headers may be any length, so they go out whole, just as
+	   header_bytes() counts them, not through data_write()'s buffer */
+	for(i = 0; i < header_count; i++) {
+		if(spool_fp == (FILE *)NULL) {
+			if(log_level > 0) {
+				log_event(LOG_INFO, "%s\n", (header_buf + headers[i].off));
+			}
+
+			if(minus_v) {
+				(void)fprintf(stderr, "[->] %s\n", (header_buf + headers[i].off));
+			}
+		}
+		res |= msg_write(fd, response,
+			(header_buf + headers[i].off), headers[i].len);
+		res |= msg_write(fd, response, "\r\n", 2);
+	}
+
+	/* End of headers, start body */
+	res |= data_write(fd, response, "");
+
+	return(res);
+}
+
+/*
+header_bytes() -- How many characters header_write() sends
+*/
+long header_bytes(void)
+{
+	long n;
+	int i;
+
+	n = snprintf((char *)NULL, 0,
+		"Received: by %s (sSMTP sendmail emulation); %s\r\n", hostname, arpadate);
+
+	if(have_from == False) {
+		n += (strlen("From: \r\n") + strlen(from));
+	}
+
+	if(have_date == False) {
+		n += (strlen("Date: \r\n") + strlen(arpadate));
+	}
+
+#ifdef HASTO_OPTION
+	if(have_to == False) {
+		n += strlen("To: postmaster\r\n");
+	}
+#endif
+
+	for(i = 0; i < header_count; i++) {
+		n += (headers[i].len + 2);
+	}
+
+	return(n + 2);
+}
+
+/*
+msg_8bit() -- Does the message need BODY=8BITMIME (RFC 6152)?
+	Text in a file, st, is looked at from pos on.  Of text still to be
+	read from a pipe we only know the headers, and unless they say the
+	body is 7bit it may well not be
+*/
+bool_t msg_8bit(FILE *stream, struct stat *st, off_t pos, bool_t add_headers)
+{
+	char buf[RBUF_SZ];
+	ssize_t n, i;
+	size_t j;
+
+	if(add_headers) {
+		for(j = 0; j < header_len; j++) {
+			if(header_buf[j] & 0x80) {
+				return(True);
+			}
+		}
+
+		for(j = 0; (have_from == False) && from[j]; j++) {
+			if(from[j] & 0x80) {
+				return(True);
+			}
+		}
+	}
+
+	if(st == (struct stat *)NULL) {
+		return(body_7bit ? False : True);
+	}
+
+	for(; pos < st->st_size; pos += n) {
+		if((n = pread(fileno(stream), buf, sizeof(buf), pos)) <= 0) {
+			return(True);
+		}
+
+		for(i = 0; i < n; i++) {
+			if(buf[i] & 0x80) {
+				return(True);
+			}
+		}
+	}
+
+	return(False);
+}
+
+/*
+smtp_close() -- Drop the connection to the mailhub
+*/
+void smtp_close(int fd)
+{
+#ifdef HAVE_SSL
+	struct smtp_conn *c = smtp_conn(fd);
+
+	if(c->ssl) {
+		SSL_free(c->ssl);
+	}
+#endif
+	smtp_conn_free(fd);
+	(void)close(fd);
+}
+
+/*
+smtp_quit() -- Say goodbye to the mailhub and close the connection
+	Not possible in the middle of a message, where QUIT would be text
+*/
+void smtp_quit(int fd)
+{
+	char buf[(BUF_SZ + 1)];
+
+	if(smtp_conn(fd)->mid_message == False) {
+		smtp_write(fd, "QUIT");
+		(void)smtp_okay(fd, buf);
+	}
+	smtp_close(fd);
+}
+
+/*
+smtp_session() -- Connect to a mailhub, greet it and log in
+	Returns the socket, or -1 with the reason in response
+*/
+int smtp_session(char *host, int port, char *response)
+{
+#ifdef MD5AUTH
+	char challenge[(BUF_SZ + 1)];
+#endif
+	char buf[(BUF_SZ + 1)];
+	int sock, res;
+
+	if((sock = smtp_open(host, port)) == -1) {
+		return(smtp_fail(response, "Cannot open %s:%d", host, port));
+	}
+	else if (smtp_starttls(host) == False) /* no initial response after STARTTLS */
+	{
+		if(smtp_okay(sock, buf) == False) {
+			smtp_close(sock);
+			return(smtp_fail(response, "Invalid response SMTP server (%s)", buf));
+		}
+	}
+
+	/* Always try EHLO first so we learn which extensions we may use */
+	if((res = smtp_ehlo(sock, buf)) == False) {
+		smtp_write(sock, "HELO %s", hostname);
+		res = smtp_okay(sock, buf);
+	}
+
+	if(res == False) {
+		smtp_close(sock);
+		return(smtp_fail(response, "%s (%s)", buf, hostname));
+	}
+
+#ifdef HAVE_SSL
+	/* By now the server has sent any session tickets */
+	tls_session_save(sock);
+#endif
+
+	/* Try to log in if username was supplied; it is for the mailhub,
+	   not for Route mailhubs or the MX hosts of whoever we send to */
+	if(auth_user && hub_ours(host)) {
+#ifdef MD5AUTH
+		if(auth_pass == (char *)NULL) {
+			auth_pass = strdup("");
+		}
+
+		/* Prefer CRAM-MD5 over sending the password if it's offered */
+		if((auth_method == (char *)NULL) && esmtp_auth(sock, "CRAM-MD5")) {
+			auth_method = "cram-md5";
+		}
+
+		if(auth_method && (strcasecmp(auth_method, "cram-md5") == 0)) {
+			smtp_write(sock, "AUTH CRAM-MD5");
+
+			if(smtp_read(sock, buf) != 3) {
+				smtp_close(sock);
+				return(smtp_fail(response,
+					"Server rejected AUTH CRAM-MD5 (%s)", buf));
+			}
+			strncpy(challenge, strchr(buf,' ') + 1, sizeof(challenge));
+
+			memset(buf, 0, sizeof(buf));
+			crammd5(challenge, auth_user, auth_pass, buf);
+		}
+		else {
+#endif
+		    memset(buf, 0, sizeof(buf));
+		    to64frombits(buf, auth_user, strlen(auth_user));
+		    smtp_write(sock, "AUTH LOGIN %s", buf);
+
+		    if(smtp_read(sock, buf) != 3) {
+			smtp_close(sock);
+			return(smtp_fail(response,
+				"Server didn't accept AUTH LOGIN (%s)", buf));
+		    }
+		    memset(buf, 0, sizeof(buf));
+
+		    to64frombits(buf, auth_pass, strlen(auth_pass));
+#ifdef MD5AUTH
+		}
+#endif
+		smtp_write(sock, "%s", buf);
+
+		if(smtp_okay(sock, buf) == False) {
+			smtp_close(sock);
+			return(smtp_fail(response, "Authorization failed (%s)", buf));
+		}
+	}
+
+	return(sock);
+}
+
+/*
+smtp_message() -- Run one mail transaction over an open session
+	The text comes from stream and looks like format says; with
+	add_headers the headers we collected go out in front of it.
+	Returns 0 with the final reply in response, or -1 with the reason
+*/
+int smtp_message(int fd, char *response, char *sender, rcpt_t *rcpts,
+	FILE *stream, int format, bool_t add_headers)
+{
+	struct smtp_conn *c = smtp_conn(fd);
+	char buf[(BUF_SZ + 1)], param[(BUF_SZ + 1)];
+	struct stat st, *file = (struct stat *)NULL;
+	long size, known = 0;
+	size_t used = 0;
+	off_t pos = 0;
+	rcpt_t *r;
+	int res;
+
+	/* Text in a file is as long as what is left of it, near enough */
+	if((fstat(fileno(stream), &st) == 0) && S_ISREG(st.st_mode)
+		&& ((pos = ftello(stream)) != -1)) {
+		file = &st;
+		known = ((st.st_size - pos) + (add_headers ? header_bytes() : 0));
+	}
+	*param = '\0';
+
+	if(c->ext[EXT_SIZE].offered && (known > 0)) {
+		/* Don't bother sending a message the mailhub already said it won't take */
+		size = strtol(c->ext[EXT_SIZE].params, (char **)NULL, 10);
+
+		if((size > 0) && (known > size)) {
+			return(smtp_fail(response,
+				"552 Message is %ld bytes, the mailhub accepts at most %ld",
+				known, size));
+		}
+		used += snprintf(param, sizeof(param), " SIZE=%ld", known);
+	}
+
+	if(c->ext[EXT_8BITMIME].offered
+		&& msg_8bit(stream, file, (file ? pos : 0), add_headers)) {
+		(void)snprintf((param + used), (sizeof(param) - used), " BODY=8BITMIME");
+	}
+
+	/* Send "MAIL FROM:" line */
+	smtp_write(fd, "MAIL FROM:<%s>%s", sender, param);
+
+	if(smtp_pipeline(fd, response) == -1) {
+		return(-1);
+	}
+
+	/* Send all the To: adresses */
+	for(r = rcpts; r->next; r = r->next) {
+		smtp_write(fd, "RCPT TO:<%s>", r->string);
+
+		if(smtp_pipeline(fd, response) == -1) {
+			return(-1);
+		}
+	}
+
+	/* With CHUNKING the message goes out in BDAT chunks instead of DATA.
+	   Dot-stuffed input has to go out with DATA, though */
+	c->use_bdat = c->ext[EXT_CHUNKING].offered && (format != ZC_STUFFED);
+
+	if(c->use_bdat == False) {
+		/* Send DATA, the last command of a pipelined group */
+		smtp_write(fd, "DATA");
+
+		res = smtp_sync(fd, response);
+
+		if(smtp_read(fd, buf) != 3) {
+			/* Oops, we were expecting "354 send your data" */
+			return((res == -1) ? -1 : smtp_fail(response, "%s", buf));
+		}
+
+		if(res == -1) {
+			/* A pipelined RCPT failed but DATA went through anyway;
+			   the only way out now is to drop the connection */
+			c->mid_message = True;
+			return(-1);
+		}
+	}
+	else if(smtp_sync(fd, response) == -1) {
+		/* BDAT LAST would have the mailhub take the message for
+		   those recipients it did accept, and a retry send it twice */
+		return(-1);
+	}
+	c->mid_message = True;
+
+	if(add_headers && (header_write(fd, response) == -1)) {
+		return(-1);
+	}
+
+	if((res = zc_body(fd, response, stream, format)) == -1) {
+		return(-1);
+	}
+	else if(res == 1) {
+		/* Sent without us ever looking at it */
+	}
+	else if(c->use_bdat) {
+		if((msg_body(fd, response, stream, False) == -1)
+			|| (bdat_send(fd, response, True) == -1)) {
+			return(-1);
+		}
+	}
+	else {
+		if(msg_body(fd, response, stream, True) == -1) {
+			return(-1);
+		}
+		/* End of body */
+
+		smtp_write(fd, ".");
+	}
+	res = smtp_sync(fd, response);
+
+	if((smtp_okay(fd, buf) == 0) && (res == 0)) {
+		res = smtp_fail(response, "%s", buf);
+	}
+	else if(res == 0) {
+		(void)strcpy(response, buf);
+	}
+	c->mid_message = False;
+
+	return(res);
+}
+
+/*
+smtp_permanent() -- Tell if a failure means retrying won't help
+	That is a 5xx reply; anything else is temporary or our own trouble
+*/
+bool_t smtp_permanent(char *response)
+{
+	return((response[0] == '5') && isdigit(response[1]) && isdigit(response[2]));
+}
+
+/*
+queue_path() -- Name a file of a queued message: qf, df, tf or Qf
+*/
+char *queue_path(char *path, char *kind, char *id)
+{
+	if(snprintf(path, MAXPATHLEN, "%s/%s%s", queue_dir, kind, id) == -1) {
+		die("queue_path() -- snprintf() failed");
+	}
+
+	return(path);
+}
+
+/*
+queue_check() -- Make sure only its owner can put files into QueueDir
+	A sticky directory will do as well, since no file in it is used
+	unless it belongs to the owner.  Returns False, with the reason
+	logged, if the directory is not safe
+*/
+bool_t queue_check(void)
+{
+	struct stat st;
+
+	if(stat(queue_dir, &st) == -1) {
+		log_event(LOG_ERR, "Cannot use %s: %s", queue_dir, strerror(errno));
+		return(False);
+	}
+
+	if(S_ISDIR(st.st_mode) == 0) {
+		log_event(LOG_ERR, "Cannot use %s: not a directory", queue_dir);
+		return(False);
+	}
+
+	if((st.st_mode & (S_IWGRP | S_IWOTH)) && ((st.st_mode & S_ISVTX) == 0)) {
+		log_event(LOG_ERR, "Not using %s, others can write to it", queue_dir);
+		return(False);
+	}
+	queue_uid = st.st_uid;
+
+	return(True);
+}
+
+/*
+queue_create() -- Create a file of a queued message, which must not
+	be there yet.  Only the owner of QueueDir and root may; files root
+	creates are given to the owner
+*/
+int queue_create(char *path)
+{
+	int fd;
+
+	if((geteuid() != 0) && (geteuid() != queue_uid)) {
+		errno = EACCES;
+		return(-1);
+	}
+
+	if((fd = open(path, (O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW), 0600)) == -1) {
+		return(-1);
+	}
+
+	if((geteuid() != queue_uid) && (fchown(fd, queue_uid, (gid_t)-1) == -1)) {
+		(void)close(fd);
+		(void)unlink(path);
+		return(-1);
+	}
+
+	return(fd);
+}
+
+/*
+queue_open() -- Open a file of a queued message, but only one that
+	queue_create() could have made: a plain file of the owner of
+	QueueDir with no other links.  Anything else someone else put there
+*/
+int queue_open(char *path, int flags)
+{
+	struct stat st;
+	int fd;
+
+	if((fd = open(path, (flags | O_NOFOLLOW))) == -1) {
+		return(-1);
+	}
+
+	if(fstat(fd, &st) == -1) {
+		(void)close(fd);
+		return(-1);
+	}
+
+	/* It may just have been delivered and removed */
+	if((st.st_nlink == 0) && S_ISREG(st.st_mode) && (st.st_uid == queue_uid)) {
+		(void)close(fd);
+		errno = ENOENT;
+		return(-1);
+	}
+
+	if((S_ISREG(st.st_mode) == 0) || (st.st_nlink != 1) || (st.st_uid != queue_uid)) {
+		log_event(LOG_ERR, "Ignoring %s, it is not a file ssmtp queued", path);
+
+		(void)close(fd);
+		errno = EPERM;
+		return(-1);
+	}
+
+	return(fd);
+}
+
+/*
+queue_envelope() -- Write the envelope of a message to fp, one line
+	per item, as it is kept in qf<id> and handed to the -bd daemon
+*/
+void queue_envelope(FILE *fp, queue_t *q)
+{
+	rcpt_t *r;
+
+	(void)fprintf(fp, "T%ld\nF%d\nH%s:%d\nS%s\n",
+		(long)q->ctime, q->format, q->host, q->port, q->sender);
+
+	for(r = &q->rcpts; r->next; r = r->next) {
+		(void)fprintf(fp, "R%s\n", r->string);
+	}
+
+	if(q->error) {
+		(void)fprintf(fp, "E%s\n", q->error);
+	}
+}
+
+/*
+queue_save() -- Write the envelope of a queued message
+	It goes to tf<id> first and only replaces qf<id> once it is on
+	disk, locked, so the message is never missing or half written.
+	Returns the locked fd, or -1
+*/
+int queue_save(queue_t *q)
+{
+	char tf[(MAXPATHLEN + 1)], qf[(MAXPATHLEN + 1)];
+	FILE *fp;
+	int fd;
+
+	(void)queue_path(tf, "tf", q->id);
+	(void)queue_path(qf, "qf", q->id);
+
+	/* One a run that died left behind */
+	(void)unlink(tf);
+
+	if((fd = queue_create(tf)) == -1) {
+		log_event(LOG_ERR, "Cannot create %s: %s", tf, strerror(errno));
+		return(-1);
+	}
+	(void)flock(fd, LOCK_EX);
+
+	if((fp = fdopen(dup(fd), "w")) == (FILE *)NULL) {
+		die("queue_save() -- fdopen() failed");
+	}
+	queue_envelope(fp, q);
+
+	if((fflush(fp) == EOF) || (fsync(fileno(fp)) == -1)
+		|| (fclose(fp) == EOF) || (rename(tf, qf) == -1)) {
+		log_event(LOG_ERR, "Cannot write %s: %s", qf, strerror(errno));
+		(void)unlink(tf);
+		(void)close(fd);
+		return(-1);
+	}
+
+	return(fd);
+}
+
+/*
+queue_parse() -- Read an envelope written by queue_envelope() from fp
+	It ends at EOF or at an empty line
+*/
+bool_t queue_parse(FILE *fp, char *id, queue_t *q)
+{
+	char buf[(BUF_SZ + 1)], *p;
+
+	(void)memset(q, 0, sizeof(*q));
+	(void)snprintf(q->id, sizeof(q->id), "%s", id);
+	q->format = ZC_CRLF;
+	q->port = port;
+
+	rcpt_start(&q->rcpts);
+	while(fgets(buf, sizeof(buf), fp) && (buf[0] != '\n')) {
+		if((p = strchr(buf, '\n'))) {
+			*p = '\0';
+		}
+
+		switch(buf[0]) {
+			case 'T':
+				q->ctime = (time_t)strtol((buf + 1), (char **)NULL, 10);
+				break;
+
+			case 'F':
+				q->format = atoi(buf + 1);
+				break;
+
+			case 'H':
+				if((p = strrchr(buf, ':'))) {
+					*p++ = '\0';
+					q->port = atoi(p);
+				}
+				q->host = arena_strdup(&msg_arena, (buf + 1));
+				break;
+
+			case 'S':
+				q->sender = arena_strdup(&msg_arena, (buf + 1));
+				break;
+
+			case 'R':
+				rcpt_save(buf + 1);
+				break;
+
+			case 'E':
+				q->error = arena_strdup(&msg_arena, (buf + 1));
+				break;
+
+			case 'L':
+				q->size = strtol((buf + 1), (char **)NULL, 10);
+				break;
+		}
+	}
+
+	if(q->host == (char *)NULL) {
+		q->host = mailhost;
+	}
+
+	return(((q->sender == (char *)NULL) || (q->rcpts.next == (rcpt_t *)NULL))
+		? False : True);
+}
+
+/*
+queue_load() -- Read the envelope of a queued message from fd
+*/
+bool_t queue_load(int fd, char *id, queue_t *q)
+{
+	bool_t res;
+	FILE *fp;
+
+	if((lseek(fd, 0, SEEK_SET) == -1)
+		|| ((fp = fdopen(dup(fd), "r")) == (FILE *)NULL)) {
+		(void)memset(q, 0, sizeof(*q));
+		return(False);
+	}
+	res = queue_parse(fp, id, q);
+	(void)fclose(fp);
+
+	return(res);
+}
+
+/*
+queue_free() -- Release what queue_parse() allocated
+	Along with everything else msg_arena holds for the message
+*/
+void queue_free(queue_t *q)
+{
+	arena_reset(&msg_arena);
+	(void)memset(q, 0, sizeof(*q));
+}
+
+/*
+queue_remove() -- Take a message out of the queue
+*/
+void queue_remove(queue_t *q)
+{
+	char path[(MAXPATHLEN + 1)];
+
+	(void)unlink(queue_path(path, "df", q->id));
+	(void)unlink(queue_path(path, "qf", q->id));
+}
+
+/*
+spool_write() -- Write the message text from stream to fp, with our
+	headers in front of it if add_headers, and <CR/LF>s
+*/
+int spool_write(FILE *fp, FILE *stream, bool_t add_headers)
+{
 	char buf[(BUF_SZ + 1)];
+	int res = 0;
+
+	spool_fp = fp;
+
+	if(add_headers) {
+		res = header_write(-1, buf);
+	}
+	res |= msg_body(-1, buf, stream, False);
+
+	spool_fp = (FILE *)NULL;
+
+	if((res == -1) || (fflush(fp) == EOF) || ferror(fp)) {
+		return(-1);
+	}
+
+	return(0);
+}
+
+/*
+queue_id() -- Give a new queue entry its id
+*/
+void queue_id(queue_t *q)
+{
+	static int seq = 0;
+
+	q->ctime = time((time_t *)NULL);
+	(void)snprintf(q->id, sizeof(q->id), "%lx.%d.%d",
+		(long)q->ctime, (int)getpid(), seq++);
+}
+
+/*
+queue_spool() -- Queue the message on stream for sender and the rcpts
+	The df<id> file holds the text as it will be sent, with our headers
+	and <CR/LF>s.  Returns the locked fd of qf<id>, or -1 if nothing
+	has been read from stream yet
+*/
+int queue_spool(queue_t *q, FILE *stream)
+{
+	char path[(MAXPATHLEN + 1)];
+	int fd, res;
+	FILE *fp;
+
+	queue_id(q);
+
+	(void)queue_path(path, "df", q->id);
+	if((fd = queue_create(path)) == -1) {
+		log_event(LOG_ERR, "Cannot create %s: %s", path, strerror(errno));
+		return(-1);
+	}
+
+	if((fp = fdopen(fd, "w")) == (FILE *)NULL) {
+		die("queue_spool() -- fdopen() failed");
+	}
+
+	/* Already dot-stuffed text is kept that way */
+	q->format = (zero_copy == ZC_STUFFED) ? ZC_STUFFED : ZC_CRLF;
+
+	res = spool_write(fp, stream, True);
+
+	if((res == -1) || (fsync(fd) == -1)) {
+		res = -1;
+	}
+	(void)fclose(fp);
+
+	if((res == -1) || ((fd = queue_save(q)) == -1)) {
+		/* stream is used up, what made it to disk is all we have */
+		(void)freopen(path, "r", stdin);
+		(void)unlink(path);
+
+		die("Cannot queue message in %s", queue_dir);
+	}
+
+	return(fd);
+}
+
+/*
+queue_link() -- Queue the message already queued as from once more,
+	for the rcpts of q.  The text is copied; a df<id> with more than
+	one link is not trusted, see queue_open()
+	Returns the locked fd of qf<id>, or -1
+*/
+int queue_link(queue_t *q, queue_t *from)
+{
+	char df[(MAXPATHLEN + 1)], path[(MAXPATHLEN + 1)], buf[RBUF_SZ];
+	int in, out, fd = -1;
+	ssize_t n;
+
+	queue_id(q);
+	q->format = from->format;
+
+	if((in = queue_open(queue_path(df, "df", from->id), O_RDONLY)) == -1) {
+		log_event(LOG_ERR, "Cannot open %s: %s", df, strerror(errno));
+		return(-1);
+	}
+
+	if((out = queue_create(queue_path(path, "df", q->id))) == -1) {
+		log_event(LOG_ERR, "Cannot create %s: %s", path, strerror(errno));
+		(void)close(in);
+		return(-1);
+	}
+
+	while(((n = read(in, buf, sizeof(buf))) > 0) && (write(out, buf, n) == n)) {
+		/* Nothing */ ;
+	}
+
+	if((n != 0) || (fsync(out) == -1)) {
+		log_event(LOG_ERR, "Cannot write %s: %s", path, strerror(errno));
+	}
+	else {
+		fd = queue_save(q);
+	}
+	(void)close(out);
+	(void)close(in);
+
+	if(fd == -1) {
+		(void)unlink(path);
+	}
+
+	return(fd);
+}
+
+/*
+queue_defer() -- Leave a message in the queue for the next run
+	and note down why, for mailq
+*/
+void queue_defer(queue_t *q, int *fd, char *reason)
+{
+	int res;
+
+	q->error = arena_strdup(&msg_arena, reason);
+
+	if((res = queue_save(q)) != -1) {
+		(void)close(*fd);
+		*fd = res;
+	}
+	log_event(LOG_INFO, "Deferred mail %s for %s (%s)",
+		q->id, q->sender, reason);
+}
+
+/*
+smtp_deliver() -- Send the message on stream over *sock, first opening
+	a session to the mailhub if there is none.  A session that is kept
+	for the next message is left in *sock.  Returns 0 once delivered,
+	2 if the mailhub can't be reached and -1 with the reason in response
+*/
+int smtp_deliver(int *sock, queue_t *q, FILE *stream, char *response)
+{
+	int res;
+
+	/* A session that is reused starts every transaction afresh */
+	if(*sock != -1) {
+		smtp_write(*sock, "RSET");
+
+		if(smtp_okay(*sock, response) == 0) {
+			smtp_close(*sock);
+			*sock = -1;
+		}
+	}
+
+	if((*sock == -1)
+		&& ((*sock = smtp_session(q->host, q->port, response)) == -1)) {
+		return(2);
+	}
+
+	res = smtp_message(*sock, response, q->sender, &q->rcpts, stream,
+		q->format, False);
+
+	/* Halfway through the text there is no way to go on */
+	if(smtp_conn(*sock)->mid_message) {
+		smtp_close(*sock);
+		*sock = -1;
+	}
+
+	return(res);
+}
+
+/*
+queue_deliver() -- Try to hand a queued message to its mailhub
+	sock is the session to use, or -1 to open one, and is left open
+	for the next message when possible.  fd is the lock on qf<id>; it
+	changes when the envelope is rewritten.  Returns 0 once delivered,
+	1 if the message stays in the queue, 2 if it does because the
+	mailhub can't be reached and -1 if the mailhub refused it for good,
+	with the reason in response
+*/
+int queue_deliver(queue_t *q, int *fd, int *sock, char *response)
+{
+	char path[(MAXPATHLEN + 1)];
+	FILE *fp;
+	int res;
+
+	if(((res = queue_open(queue_path(path, "df", q->id), O_RDONLY)) == -1)
+		|| ((fp = fdopen(res, "r")) == (FILE *)NULL)) {
+		return(smtp_fail(response, "Cannot open %s: %s", path, strerror(errno)));
+	}
+
+	if((*sock == -1) && pool_socket && (minus_q == False)
+		&& (strcmp(q->host, mailhost) == 0)
+		&& ((res = pool_send(q, fp, False, response)) != 2)) {
+		/* The -bd daemon took care of it */
+	}
+	else {
+		res = smtp_deliver(sock, q, fp, response);
+	}
+	(void)fclose(fp);
+
+	if(res == 0) {
+		queue_remove(q);
+		log_event(LOG_INFO, "Sent mail %s for %s (%s)",
+			q->id, q->sender, response);
+
+		return(0);
+	}
+
+	if(smtp_permanent(response)) {
+		return(-1);
+	}
+	queue_defer(q, fd, response);
+
+	return((res == 2) ? 2 : 1);
+}
+
+/*
+detach() -- Leave the rest of the work to a child of its own session
+	Returns True in the parent, which is done, and False in the child
+	(or when there is no child), which carries on
+*/
+bool_t detach(void)
+{
+	int fd;
+
+	switch(fork()) {
+		case -1:
+			log_event(LOG_ERR, "Cannot fork, staying in the foreground");
+			return(False);
+
+		case 0:
+			break;
+
+		default:
+			return(True);
+	}
+
+	/* Whoever called us may be waiting for our output to end */
+	(void)setsid();
+
+	if((fd = open("/dev/null", O_RDWR)) != -1) {
+		(void)dup2(fd, 0);
+		(void)dup2(fd, 1);
+		(void)dup2(fd, 2);
+
+		if(fd > 2) {
+			(void)close(fd);
+		}
+	}
+
+	return(False);
+}
+
+/*
+queue_work() -- Try to deliver everything in the queue for one mailhub
+	(or for all of them, without a host).  Messages for the same mailhub
+	share one session, and once a mailhub can't be reached the rest of
+	its messages wait for the next run
+*/
+int queue_work(char *only_host, int only_port)
+{
+	char path[(MAXPATHLEN + 1)], qf[(MAXPATHLEN + 1)], buf[(BUF_SZ + 1)];
+	char down[(BUF_SZ + 1)], *host = (char *)NULL;
+	int fd, sock = -1, hport = 0, sent = 0, deferred = 0;
+	bool_t host_down = False;
+	struct dirent *de;
+	struct stat st;
+	queue_t q;
+	DIR *dir;
+
+	if((dir = opendir(queue_dir)) == (DIR *)NULL) {
+		die("Cannot open %s: %s", queue_dir, strerror(errno));
+	}
+
+	while((de = readdir(dir))) {
+		if(strncmp(de->d_name, "qf", 2) != 0) {
+			continue;
+		}
+
+		/* Someone else may be busy with it, or it may be gone already */
+		if((fd = queue_open(queue_path(qf, "qf", (de->d_name + 2)), O_RDWR)) == -1) {
+			continue;
+		}
+
+		/* Leave other mailhubs' messages alone, without even locking them */
+		if(only_host) {
+			if((queue_load(fd, (de->d_name + 2), &q) == False)
+				|| strcmp(q.host, only_host) || (q.port != only_port)) {
+				queue_free(&q);
+				(void)close(fd);
+				continue;
+			}
+			queue_free(&q);
+		}
+
+		if((flock(fd, (LOCK_EX | LOCK_NB)) == -1)
+			|| (fstat(fd, &st) == -1) || (st.st_nlink == 0)) {
+			(void)close(fd);
+			continue;
+		}
+
+		if(queue_load(fd, (de->d_name + 2), &q) == False) {
+			log_event(LOG_ERR, "Cannot read %s", qf);
+
+			queue_free(&q);
+			(void)close(fd);
+			continue;
+		}
+
+		/* A different mailhub needs a session of its own */
+		if((host == (char *)NULL) || strcmp(q.host, host) || (q.port != hport)) {
+			if(sock != -1) {
+				smtp_quit(sock);
+				sock = -1;
+			}
+			free(host);
+
+			host = strdup(q.host);
+			hport = q.port;
+			host_down = False;
+		}
+
+		if(host_down) {
+			queue_defer(&q, &fd, down);
+			deferred++;
+
+			queue_free(&q);
+			(void)close(fd);
+			continue;
+		}
+
+		switch(queue_deliver(&q, &fd, &sock, buf)) {
+			case 0:
+				sent++;
+				break;
+
+			case 2:
+				(void)strcpy(down, buf);
+				host_down = True;
+				/* Fall through */
+
+			case 1:
+				deferred++;
+				break;
+
+			default:
+				/* Keep it around for the admin, but stop trying */
+				(void)rename(qf, queue_path(path, "Qf", q.id));
+				log_event(LOG_ERR, "Failed mail %s for %s (%s)",
+					q.id, q.sender, buf);
+		}
+		queue_free(&q);
+
+		(void)close(fd);
+	}
+	(void)closedir(dir);
+
+	if(sock != -1) {
+		smtp_quit(sock);
+	}
+	free(host);
+
+	if(sent || deferred) {
+		log_event(LOG_INFO, "Queue run: %d sent, %d deferred", sent, deferred);
+	}
+
+	return(0);
+}
+
+/*
+queue_run() -- Try to deliver everything in the queue (-q)
+	With MaxConnections above 1, each mailhub gets up to that many
+	worker processes, each with a session of its own; they share out
+	the messages through the locks on them
+*/
+int queue_run(void)
+{
+	char path[(MAXPATHLEN + 1)];
+	struct queue_hub *hubs = (struct queue_hub *)NULL;
+	int fd, i, n, nhubs = 0;
+	struct dirent *de;
+	queue_t q;
+	DIR *dir;
+
+	if(max_connections <= 1) {
+		return(queue_work((char *)NULL, 0));
+	}
+
+	if((dir = opendir(queue_dir)) == (DIR *)NULL) {
+		die("Cannot open %s: %s", queue_dir, strerror(errno));
+	}
+
+	/* Count what there is for each mailhub */
+	while((de = readdir(dir))) {
+		if((strncmp(de->d_name, "qf", 2) != 0)
+			|| ((fd = queue_open(queue_path(path, "qf", (de->d_name + 2)), O_RDONLY)) == -1)) {
+			continue;
+		}
+
+		if(queue_load(fd, (de->d_name + 2), &q) == True) {
+			for(i = 0; i < nhubs; i++) {
+				if((strcmp(hubs[i].host, q.host) == 0) && (hubs[i].port == q.port)) {
+					break;
+				}
+			}
+
+			if(i == nhubs) {
+				hubs = (struct queue_hub *)realloc(hubs,
+					((nhubs + 1) * sizeof(struct queue_hub)));
+				if(hubs == (struct queue_hub *)NULL) {
+					die("queue_run() -- realloc() failed");
+				}
+
+				if((hubs[i].host = strdup(q.host)) == (char *)NULL) {
+					die("queue_run() -- strdup() failed");
+				}
+				hubs[i].port = q.port;
+				hubs[i].count = 0;
+				nhubs++;
+			}
+			hubs[i].count++;
+		}
+		queue_free(&q);
+
+		(void)close(fd);
+	}
+	(void)closedir(dir);
+
+	(void)fflush(stdout);
+	(void)fflush(stderr);
+
+	/* No point in more workers than messages */
+	for(i = 0; i < nhubs; i++) {
+		for(n = 0; (n < max_connections) && (n < hubs[i].count); n++) {
+			switch(fork()) {
+				case -1:
+					log_event(LOG_ERR, "Cannot fork a queue worker");
+					break;
+
+				case 0:
+					exit(queue_work(hubs[i].host, hubs[i].port));
+			}
+		}
+		free(hubs[i].host);
+	}
+	free(hubs);
+
+	while((wait((int *)NULL) != -1) || (errno == EINTR));
+
+	return(0);
+}
+
+/*
+queue_list() -- Show what is waiting in the queue (-bp, mailq)
+*/
+int queue_list(void)
+{
+	char path[(MAXPATHLEN + 1)], date[32];
+	struct dirent *de;
+	struct stat st;
+	int fd, count = 0;
+	queue_t q;
+	rcpt_t *r;
+	DIR *dir;
+
+	if((queue_dir == (char *)NULL)
+		|| ((dir = opendir(queue_dir)) == (DIR *)NULL)) {
+		(void)fprintf(stderr, "%s: Mail queue is empty\n", prog);
+		return(0);
+	}
+
+	while((de = readdir(dir))) {
+		if(strncmp(de->d_name, "qf", 2) != 0) {
+			continue;
+		}
+
+		if((fd = queue_open(queue_path(path, "qf", (de->d_name + 2)), O_RDONLY)) == -1) {
+			continue;
+		}
+
+		if(queue_load(fd, (de->d_name + 2), &q) == True) {
+			if(stat(queue_path(path, "df", q.id), &st) == -1) {
+				st.st_size = 0;
+			}
+			(void)strftime(date, sizeof(date), "%a %b %d %H:%M",
+				localtime(&q.ctime));
+
+			if(count++ == 0) {
+				(void)printf("%-24s %8s %-16s %s\n",
+					"Queue ID", "Size", "Queued", "Sender/Recipient");
+			}
+			(void)printf("%-24s %8ld %-16s %s\n",
+				q.id, (long)st.st_size, date, q.sender);
+
+			if(q.error) {
+				(void)printf("%51s(%s)\n", "", q.error);
+			}
+
+			for(r = &q.rcpts; r->next; r = r->next) {
+				(void)printf("%51s%s\n", "", r->string);
+			}
+		}
+		queue_free(&q);
+
+		(void)close(fd);
+	}
+	(void)closedir(dir);
+
+	if(count == 0) {
+		(void)fprintf(stderr, "%s: Mail queue is empty\n", prog);
+		return(0);
+	}
+	(void)printf("\tTotal requests: %d\n", count);
+
+	return(0);
+}
+
+/*
+pool_send() -- Hand a message to the -bd daemon listening on PoolSocket
+	The daemon gets the envelope with the length of the text, an empty
+	line and then the text, and answers with the final reply of its
+	mailhub.  Returns 2, having read nothing from stream, if there is
+	no daemon or the text is dot-stuffed, otherwise 0 once the mailhub took the message and -1
+	with the reason in response
+*/
+int pool_send(queue_t *q, FILE *stream, bool_t add_headers, char *response)
+{
+	char buf[RBUF_SZ], *p;
+	struct pollfd fds[1];
+	struct sockaddr_un sun;
+	FILE *fp, *tmp;
+	size_t n;
+	int fd;
+
+	/* The daemon takes no text that is already dot-stuffed, see
+	   pool_serve(); that goes straight to the mailhub */
+	if((add_headers ? zero_copy : q->format) == ZC_STUFFED) {
+		return(2);
+	}
+
+	if((fd = socket(PF_UNIX, SOCK_STREAM, 0)) == -1) {
+		return(2);
+	}
+
+	(void)memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	(void)strncpy(sun.sun_path, pool_socket, (sizeof(sun.sun_path) - 1));
+
+	if(connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		if(log_level > 0) {
+			log_event(LOG_INFO, "No daemon on %s: %s", pool_socket,
+				strerror(errno));
+		}
+		(void)close(fd);
+
+		return(2);
+	}
+
+	if(add_headers) {
+		q->format = ZC_CRLF;
+	}
+
+	/* The length goes first, so a daemon can tell when we died halfway */
+	if(((tmp = tmpfile()) == (FILE *)NULL)
+		|| (spool_write(tmp, stream, add_headers) == -1)
+		|| ((q->size = ftell(tmp)) == -1) || (fseek(tmp, 0, SEEK_SET) == -1)) {
+		if(tmp) {
+			(void)fclose(tmp);
+		}
+		(void)close(fd);
 
-	/* Init SSL stuff */
-	SSL_CTX *ctx;
-	SSL_METHOD *meth;
-	X509 *server_cert;
+		return(smtp_fail(response, "Cannot spool message: %s",
+			strerror(errno)));
+	}
 
-	SSL_load_error_strings();
-	SSLeay_add_ssl_algorithms();
-	meth=SSLv23_client_method();
-	ctx = SSL_CTX_new(meth);
-	if(!ctx) {
-		log_event(LOG_ERR, "No SSL support initiated\n");
-		return(-1);
+	if((fp = fdopen(dup(fd), "w")) == (FILE *)NULL) {
+		die("pool_send() -- fdopen() failed");
 	}
+	queue_envelope(fp, q);
+	(void)fprintf(fp, "L%ld\n\n", q->size);
 
-	if(use_cert == True) { 
-		if(SSL_CTX_use_certificate_chain_file(ctx, tls_cert) <= 0) {
-			perror("Use certfile");
-			return(-1);
-		}
+	while((n = fread(buf, 1, sizeof(buf), tmp)) > 0) {
+		(void)fwrite(buf, 1, n, fp);
+	}
 
-		if(SSL_CTX_use_PrivateKey_file(ctx, tls_cert, SSL_FILETYPE_PEM) <= 0) {
-			perror("Use PrivateKey");
-			return(-1);
-		}
+	if(ferror(tmp) || (fflush(fp) == EOF) || ferror(fp)
+		|| (fclose(fp) == EOF) || (shutdown(fd, SHUT_WR) == -1)) {
+		(void)fclose(tmp);
+		(void)close(fd);
+		return(smtp_fail(response, "Lost connection to the daemon"));
+	}
+	(void)fclose(tmp);
 
-		if(!SSL_CTX_check_private_key(ctx)) {
-			log_event(LOG_ERR, "Private key does not match the certificate public key\n");
-			return(-1);
-		}
+	if((fp = fdopen(fd, "r")) == (FILE *)NULL) {
+		die("pool_send() -- fdopen() failed");
 	}
-#endif
 
-#ifdef INET6
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = p_family;
-	hints.ai_socktype = SOCK_STREAM;
-	snprintf(servname, sizeof(servname), "%d", port);
+	/* The daemon answers once the mailhub has; others may run meanwhile */
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
 
-	/* Check we can reach the host */
-	if (getaddrinfo(host, servname, &hints, &ai0)) {
-		log_event(LOG_ERR, "Unable to locate %s", host);
-		return(-1);
+	if((ev_poll(fds, 1, (MAXWAIT * 1000)) <= 0)
+		|| (fgets(response, BUF_SZ, fp) == NULL)) {
+		(void)smtp_fail(response, "Lost connection to the daemon");
+	}
+	else if((p = strchr(response, '\n'))) {
+		*p = '\0';
 	}
+	(void)fclose(fp);
 
-	for (ai = ai0; ai; ai = ai->ai_next) {
-		/* Create a socket for the connection */
-		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-		if (s < 0) {
-			continue;
-		}
+	if(minus_v) {
+		(void)fprintf(stderr, "[<-] %s\n", response);
+	}
 
-#ifdef CONNECT_TIMEOUT
-		fd_flags = fcntl(s, F_GETFL, 0);
-		if (fcntl(s, F_SETFL, fd_flags | O_NONBLOCK) != 0) {
-			s = -1;
-			continue;
-		}
+	return((response[0] == '2') ? 0 : -1);
+}
 
-		while (1) {
-			if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0) {
-				goto out_of_loop;
-			}
+/*
+pool_receive() -- Take the text a client of the daemon sends on in
+	It must be exactly size bytes long; anything else means the client
+	went away halfway, and NULL is returned so that nothing is sent
+*/
+FILE *pool_receive(FILE *in, long size)
+{
+	char buf[RBUF_SZ];
+	FILE *fp;
+	size_t n;
 
-			switch(errno) {
-				case EALREADY:
-				case EINPROGRESS:
-					{
-						int poll_res;
+	if((size <= 0) || ((fp = tmpfile()) == (FILE *)NULL)) {
+		return((FILE *)NULL);
+	}
 
-						poll_res = ssmtp_poll(s, POLLOUT, connect_timeout);
-						if (poll_res == SSMTP_POLL_SUCCESS) {
-							/* try again */
-							continue;
-						}
-						s = -1;
-						goto out_of_loop;
-					}
-				case EINTR:
-					continue;
-				default:
-					s = -1;
-					goto out_of_loop;
-			}
-		}
-#else
-		if (connect(s, ai->ai_addr, ai->ai_addrlen) < 0) {
-			s = -1;
-			continue;
-		}
-#endif
-		break;
+	while((size > 0) && ((n = fread(buf, 1,
+		((size < (long)sizeof(buf)) ? (size_t)size : sizeof(buf)), in)) > 0)) {
+		(void)fwrite(buf, 1, n, fp);
+		size -= n;
 	}
 
-out_of_loop:
+	if((size > 0) || (getc(in) != EOF) || (fflush(fp) == EOF) || ferror(fp)
+		|| (fseek(fp, 0, SEEK_SET) == -1)) {
+		(void)fclose(fp);
+		return((FILE *)NULL);
+	}
 
-	if(s < 0) {
-		log_event (LOG_ERR,
-			"Unable to connect to \"%s\" port %d.\n", host, port);
+	return(fp);
+}
 
-		return(-1);
+/*
+pool_sender() -- Give a message from a client of the daemon the sender
+	a set-user-ID ssmtp would give it: unless FromLineOverride is set,
+	users other than root and our own send as their revaliases
+	address, or as user@domain.  Returns False if the client's user
+	cannot be found out
+*/
+bool_t pool_sender(int client, queue_t *q)
+{
+	char *old_uad = uad, *old_hub = mailhost, *sender;
+	int old_port = port;
+	struct passwd *pw;
+	uid_t uid;
+
+	if(override_from) {
+		return(True);
 	}
-#else
-	/* Check we can reach the host */
-	if((hent = gethostbyname(host)) == (struct hostent *)NULL) {
-		log_event(LOG_ERR, "Unable to locate %s", host);
-		return(-1);
+
+	if((peer_uid(client, &uid) == -1)
+		|| ((pw = getpwuid(uid)) == (struct passwd *)NULL)) {
+		return(False);
 	}
 
-	if(hent->h_length > sizeof(hent->h_addr)) {
-		log_event(LOG_ERR, "Buffer overflow in gethostbyname()");
-		return(-1);
+	if((uid == 0) || (uid == geteuid())) {
+		return(True);
 	}
 
-	/* Create a socket for the connection */
-	if((s = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-		log_event(LOG_ERR, "Unable to create a socket");
-		return(-1);
+	/* revaliases() sets these for a sender of our own; keep ours */
+	uad = (char *)NULL;
+	revaliases(pw);
+	sender = arena_strdup(&msg_arena, append_domain(uad ? uad : pw->pw_name));
+
+	if(uad) {
+		free(uad);
+	}
+	if(mailhost != old_hub) {
+		free(mailhost);
 	}
+	uad = old_uad;
+	mailhost = old_hub;
+	port = old_port;
 
-	/* This SHOULD already be in Network Byte Order from gethostbyname() */
-	name.sin_addr.s_addr = ((struct in_addr *)(hent->h_addr))->s_addr;
-	name.sin_family = hent->h_addrtype;
-	name.sin_port = htons(port);
+	if(strcasecmp(q->sender, sender)) {
+		if(log_level > 0) {
+			log_event(LOG_INFO, "%s may not send as %s, using %s",
+				pw->pw_name, q->sender, sender);
+		}
+		q->sender = sender;
+	}
 
-	namelen = sizeof(struct sockaddr_in);
+	return(True);
+}
 
-#ifdef CONNECT_TIMEOUT
-	fd_flags = fcntl(s, F_GETFL, 0);
-	if (fcntl(s, F_SETFL, fd_flags | O_NONBLOCK) != 0) {
-		log_event(LOG_ERR, "fcntl(, O_NONBLOCK) failed");
-		return(-1);
+/*
+pool_serve() -- Deliver the message a client of the daemon sends
+	over the session in *sock, and tell the client how it went
+*/
+void pool_serve(int client, int *sock)
+{
+	char buf[(BUF_SZ + 1)];
+	FILE *in, *out, *text;
+	struct timeval tv;
+	queue_t q;
+
+	/* A client that stalls must not keep the session from everyone else */
+	tv.tv_sec = MAXWAIT;
+	tv.tv_usec = 0;
+	(void)setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if(((in = fdopen(client, "r")) == (FILE *)NULL)
+		|| ((out = fdopen(dup(client), "w")) == (FILE *)NULL)) {
+		die("pool_serve() -- fdopen() failed");
 	}
 
-	while (1) {
-		if(connect(s, (struct sockaddr *)&name, namelen) == 0) {
-			goto out_of_loop;
+	/* Text a client says is dot-stuffed would go out over DATA as it
+	   is, and could carry transactions of its own */
+	if((queue_parse(in, "", &q) == False) || (q.format != ZC_CRLF)) {
+		(void)smtp_fail(buf, "501 Bad request");
+	}
+	else if(pool_sender(client, &q) == False) {
+		(void)smtp_fail(buf, "550 Cannot tell who %s is", q.sender);
+	}
+	else if((text = pool_receive(in, q.size)) == (FILE *)NULL) {
+		(void)smtp_fail(buf, "451 Incomplete message from %s, not sent",
+			q.sender);
+	}
+	else {
+		/* Clients may have been set up for other mailhubs, we have ours */
+		q.host = mailhost;
+		q.port = port;
+
+		if(smtp_deliver(sock, &q, text, buf) == 0) {
+			log_event(LOG_INFO, "Sent mail for %s (%s)", q.sender, buf);
 		}
+		(void)fclose(text);
+	}
 
-		switch(errno) {
-			case EALREADY:
-			case EINPROGRESS:
-				{
-					int poll_res;
+	(void)fprintf(out, "%s\n", buf);
+	(void)fclose(out);
+	(void)fclose(in);
+
+	queue_free(&q);
+}
+
+/*
+pool_worker() -- Keep a session to the mailhub warm and serve clients
+	of the daemon over it, one at a time
+*/
+void pool_worker(int listen_fd)
+{
+	char buf[(BUF_SZ + 1)];
+	struct pollfd fds[1];
+	int client, sock;
+
+	/* Log in before anyone asks for it */
+	if((sock = smtp_session(mailhost, port, buf)) == -1) {
+		log_event(LOG_ERR, "%s", buf);
+	}
+
+	for(;;) {
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+
+		switch(poll(fds, 1, (KEEPALIVE * 1000))) {
+			case -1:
+				if(errno != EINTR) {
+					die("poll() failed on %s", pool_socket);
+				}
+				continue;
+
+			case 0:
+				/* Idle; make sure the mailhub doesn't drop us */
+				if(sock != -1) {
+					smtp_write(sock, "NOOP");
 
-					poll_res = ssmtp_poll(s, POLLOUT, connect_timeout);
-					if (poll_res == SSMTP_POLL_SUCCESS) {
-						/* try again */
+					if(smtp_okay(sock, buf)) {
 						continue;
 					}
-					s = -1;
-					log_event(LOG_ERR, "connect(%s:%d) timed out", host, port);
-					goto out_of_loop;
+
+					smtp_close(sock);
+					sock = -1;
 				}
-			case EINTR:
 				continue;
-			default:
-				s = -1;
-				log_event(LOG_ERR, "poll() failed on connect");
-				goto out_of_loop;
 		}
+
+		/* Another worker may have been quicker */
+		if((client = accept(listen_fd, (struct sockaddr *)NULL, NULL)) == -1) {
+			continue;
+		}
+		pool_serve(client, &sock);
 	}
+}
 
-out_of_loop:
-	if (s < 0) {
-		log_event(LOG_ERR, "Unable to connect to %s:%d", host, port);
-		return(-1);
+/*
+pool_stop() -- Take the workers down with the daemon
+*/
+void pool_stop(int sig)
+{
+	(void)signal(sig, SIG_DFL);
+	(void)kill(0, sig);
+}
+
+/*
+pool_daemon() -- Run as a daemon holding sessions to the mailhub (-bd)
+	Each of MaxConnections workers keeps one open, logged in, and uses
+	it for the messages handed over on PoolSocket
+*/
+int pool_daemon(void)
+{
+	struct sockaddr_un sun;
+	int fd, n, workers = 0;
+
+	if(pool_socket == (char *)NULL) {
+		die("-bd needs a PoolSocket");
 	}
 
-#else
-	if(connect(s, (struct sockaddr *)&name, namelen) < 0) {
-		log_event(LOG_ERR, "Unable to connect to %s:%d", host, port);
-		return(-1);
+	if((fd = socket(PF_UNIX, SOCK_STREAM, 0)) == -1) {
+		die("Cannot create a socket: %s", strerror(errno));
 	}
-#endif
-#endif
 
-#ifdef HAVE_SSL
-	if(use_tls == True) {
-		log_event(LOG_INFO, "Creating SSL connection to host");
+	(void)memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	(void)strncpy(sun.sun_path, pool_socket, (sizeof(sun.sun_path) - 1));
 
-		if (use_starttls == True)
-		{
-			use_tls=False; /* need to write plain text for a while */
+	(void)unlink(pool_socket);
+	if((bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		|| (listen(fd, SOMAXCONN) == -1)) {
+		die("Cannot listen on %s: %s", pool_socket, strerror(errno));
+	}
 
-			if (smtp_okay(s, buf))
-			{
-				smtp_write(s, "EHLO %s", hostname);
-				if (smtp_okay(s, buf)) {
-					smtp_write(s, "STARTTLS"); /* assume STARTTLS regardless */
-					if (!smtp_okay(s, buf)) {
-						log_event(LOG_ERR, "STARTTLS not working");
-						return(-1);
-					}
-				}
-				else
-				{
-					log_event(LOG_ERR, "Invalid response: %s (%s)", buf, hostname);
-				}
-			}
-			else
-			{
-				log_event(LOG_ERR, "Invalid response SMTP Server (STARTTLS)");
-				return(-1);
+	/* Anyone who may send mail may use it; pool_sender() sees to it
+	   that they do so as themselves */
+	(void)chmod(pool_socket, 0666);
+
+	/* Only one of the workers gets a client, the others must not block */
+	(void)fcntl(fd, F_SETFL, (fcntl(fd, F_GETFL, 0) | O_NONBLOCK));
+	(void)signal(SIGPIPE, SIG_IGN);
+
+	if(detach()) {
+		return(0);
+	}
+	(void)signal(SIGTERM, pool_stop);
+	(void)signal(SIGINT, pool_stop);
+
+	/* Replace workers that die */
+	for(;;) {
+		while(workers < max_connections) {
+			switch(fork()) {
+				case -1:
+					die("Cannot fork a worker: %s", strerror(errno));
+
+				case 0:
+					(void)signal(SIGTERM, SIG_DFL);
+					(void)signal(SIGINT, SIG_DFL);
+					pool_worker(fd);
+					exit(0);
 			}
-			use_tls=True; /* now continue as normal for SSL */
+			workers++;
 		}
 
-		ssl = SSL_new(ctx);
-		if(!ssl) {
-			log_event(LOG_ERR, "SSL not working");
-			return(-1);
+		if((n = wait((int *)NULL)) != -1) {
+			workers--;
 		}
-		SSL_set_fd(ssl, s);
-
-		err = SSL_connect(ssl);
-		if(err < 0) { 
-			perror("SSL_connect");
-			return(-1);
+		else if(errno != EINTR) {
+			break;
 		}
 
-		if(log_level > 0 || 1) {
-			log_event(LOG_INFO, "SSL connection using %s",
-				SSL_get_cipher(ssl));
-		}
+		/* Don't spin if the workers can't get going */
+		(void)sleep(1);
+	}
 
-		server_cert = SSL_get_peer_certificate(ssl);
-		if(!server_cert) {
-			return(-1);
+	return(0);
+}
+
+/*
+domain_match() -- Does domain match the n characters of pattern?
+	A pattern with a leading dot matches any domain below it
+*/
+bool_t domain_match(char *pattern, size_t n, char *domain)
+{
+	size_t len = strlen(domain);
+
+	if(*pattern == '.') {
+		return((len > n) && (strncasecmp(pattern, (domain + len - n), n) == 0));
+	}
+
+	return((n == len) && (strncasecmp(pattern, domain, n) == 0));
+}
+
+/*
+mx_domain() -- Is domain one of MXDomains?
+*/
+bool_t mx_domain(char *domain)
+{
+	size_t n;
+	char *p;
+
+	for(p = mx_domains; p && *(p += strspn(p, ", \t")); p += n) {
+		n = strcspn(p, ", \t");
+
+		if(domain_match(p, n, domain)) {
+			return(True);
 		}
-		X509_free(server_cert);
+	}
 
-		/* TODO: Check server cert if changed! */
+	return(False);
+}
+
+/*
+route_rule() -- Find the mailhubs a Route setting gives for domain
+*/
+char *route_rule(char *domain)
+{
+	int i;
+
+	for(i = 0; i < route_rule_count; i++) {
+		if(domain_match(route_rules[i].domain,
+			strlen(route_rules[i].domain), domain)) {
+			return(route_rules[i].hubs);
+		}
 	}
-#endif
 
-	return(s);
+	return((char *)NULL);
 }
 
 /*
-fd_getc() -- Read a character from an fd
+route_add() -- Add a recipient to a route
 */
-ssize_t fd_getc(int fd, void *c)
+void route_add(struct route *r, char *rcpt)
 {
-#ifdef READ_TIMEOUT
-	int read_bytes;
+	r->last->string = rcpt;
 
-	while (1) {
-#ifdef HAVE_SSL
-		if(use_tls == True) { 
-			read_bytes = SSL_read(ssl, c, 1);
-		} else {
-#endif
-			read_bytes = read(fd, c, 1);
-#ifdef HAVE_SSL
+	r->last->next = (rcpt_t *)arena_alloc(&msg_arena, sizeof(rcpt_t));
+	r->last = r->last->next;
+	r->last->next = (rcpt_t *)NULL;
+}
+
+/*
+route_split() -- Sort the rcpts by where they go
+	routes[0] is the mailhub.  Recipients with a Route setting go to
+	the mailhubs it gives, and those in MXDomains to the MX hosts of
+	their domain, so each destination sees the message once.  Returns
+	how many routes there are
+*/
+int route_split(rcpt_t *rcpts, struct route *routes, int max)
+{
+	char *domain, *host;
+	rcpt_t *r;
+	int i, n;
+
+	for(i = 0; i < max; i++) {
+		routes[i].rcpts.next = (rcpt_t *)NULL;
+		routes[i].last = &routes[i].rcpts;
+	}
+	routes[0].host = mailhost;
+	routes[0].port = port;
+	n = 1;
+
+	for(r = rcpts; r->next; r = r->next) {
+		i = 0;
+
+		if((domain = strrchr(r->string, '@')) == (char *)NULL) {
+			/* Local, for the mailhub */
 		}
-#endif
+		else if((host = route_rule(++domain))) {
+			for(i = 0; (i < n) && ((routes[i].port != port)
+				|| strcasecmp(routes[i].host, host)); i++) {
+				/* Nothing */ ;
+			}
 
-		if (read_bytes == -1) {
-			switch (errno) {
-				case EAGAIN:
-					{
-						int res;
+			if(i == max) {
+				log_event(LOG_ERR, "Too many routes, sending %s to the mailhub",
+					r->string);
+				i = 0;
+			}
+			else if(i == n) {
+				routes[i].host = host;
+				routes[i].port = port;
+				n++;
+			}
+		}
+		else if(mx_domain(domain)) {
+			for(i = 1; (i < n) && ((*routes[i].host != '@')
+				|| strcasecmp((routes[i].host + 1), domain)); i++) {
+				/* Nothing */ ;
+			}
 
-						res = ssmtp_poll(fd, POLLIN, read_timeout);
-						if (res == SSMTP_POLL_SUCCESS) {
-							continue;
-						}
-						log_event(LOG_ERR, "read() timed out");
-						return -1;
-					}
-				default:
-					log_event(LOG_ERR, "poll() failed on read");
-					return -1;
+			if(i == max) {
+				log_event(LOG_ERR, "Too many routes, sending %s to the mailhub",
+					r->string);
+				i = 0;
+			}
+			else if(i == n) {
+				routes[i].host = (char *)arena_alloc(&msg_arena,
+					(strlen(domain) + 2));
+				(void)sprintf(routes[i].host, "@%s", domain);
+				routes[i].port = 25;
+				n++;
 			}
-		} else {
-			return read_bytes;
 		}
+		route_add(&routes[i], r->string);
 	}
-#else
-#ifdef HAVE_SSL
-	if(use_tls == True) { 
-		return(SSL_read(ssl, c, 1));
-	}
-#endif
-	return(read(fd, c, 1));
-#endif
+
+	return(n);
 }
 
 /*
-fd_gets() -- Get characters from a fd instead of an fp
+route_failed() -- Report that the recipients of one route were not
+	sent the message, for the reason in response, when the other
+	routes were; only their copy, on stdin, goes to dead.letter
 */
-char *fd_gets(char *buf, int size, int fd)
+void route_failed(rcpt_t *rcpts, char *response)
 {
-	int i = 0;
-	char c;
+	char buf[(BUF_SZ + 1)];
+	size_t used = 0;
+	rcpt_t *r;
 
-	while((i < size) && (fd_getc(fd, &c) == 1)) {
-		if(c == '\r');	/* Strip <CR> */
-		else if(c == '\n') {
-			break;
-		}
-		else {
-			buf[i++] = c;
-		}
+	for(r = rcpts, *buf = '\0'; r->next && (used < BUF_SZ); r = r->next) {
+		used += snprintf((buf + used), (BUF_SZ - used), "%s%s",
+			(used ? ", " : ""), r->string);
 	}
-	buf[i] = '\0';
 
-	return(buf);
+	(void)fprintf(stderr, "%s: %s - not sent to %s\n", prog, response, buf);
+	log_event(LOG_ERR, "%s - not sent to %s", response, buf);
+
+	(void)fseek(stdin, 0L, SEEK_SET);
+	clearerr(stdin);
+	dead_letter();
 }
 
 /*
-smtp_read() -- Get a line and return the initial digit
+route_queue_task() -- Deliver a queued route, as a task of its own
 */
-int smtp_read(int fd, char *response)
+void route_queue_task(void *arg)
 {
-	do {
-		if(fd_gets(response, BUF_SZ, fd) == NULL) {
-			return(0);
-		}
-	}
-	while(response[3] == '-');
+	struct route_job *j = (struct route_job *)arg;
+	int sock = -1;
 
-	if(log_level > 0) {
-		log_event(LOG_INFO, "%s\n", response);
-	}
+	j->res = queue_deliver(j->q, j->fd, &sock, j->response);
+	(void)close(*j->fd);
 
-	if(minus_v) {
-		(void)fprintf(stderr, "[<-] %s\n", response);
+	if(sock != -1) {
+		smtp_quit(sock);
 	}
-
-	return(atoi(response) / 100);
 }
 
 /*
-smtp_okay() -- Get a line and test the three-number string at the beginning
-				If it starts with a 2, it's OK
+route_send_task() -- Send a route the message in j->path, as a task
+	of its own
 */
-int smtp_okay(int fd, char *response)
+void route_send_task(void *arg)
 {
-	return((smtp_read(fd, response) == 2) ? 1 : 0);
+	struct route_job *j = (struct route_job *)arg;
+	int sock, format;
+	FILE *fp;
+
+	/* Already dot-stuffed text is kept that way */
+	format = (zero_copy == ZC_STUFFED) ? ZC_STUFFED : ZC_CRLF;
+
+	/* Each task reads the text at an offset of its own */
+	if((fp = fopen(j->path, "r")) == (FILE *)NULL) {
+		j->res = smtp_fail(j->response, "Cannot open %s: %s", j->path,
+			strerror(errno));
+		return;
+	}
+
+	if(((sock = smtp_session(j->route->host, j->route->port, j->response)) == -1)
+		|| (smtp_message(sock, j->response, uad, &j->route->rcpts, fp,
+			format, False) == -1)) {
+		j->res = -1;
+	}
+	else {
+		j->res = 0;
+	}
+	(void)fclose(fp);
+
+	if(sock != -1) {
+		smtp_quit(sock);
+	}
 }
 
 /*
-fd_puts() -- Write characters to fd
+route_queue() -- Queue the message for each of the n routes, and
+	unless DeliveryMode says otherwise, try to deliver it right away
+	Returns -1, having read nothing from stdin, if it cannot be queued
 */
-ssize_t fd_puts(int fd, const void *buf, size_t count) 
+int route_queue(struct route *routes, int n, queue_t *tmpl)
 {
-#ifdef WRITE_TIMEOUT
-	int written_bytes, written_bytes_total = 0;
+	char error[(BUF_SZ + 1)], path[(MAXPATHLEN + 1)], *buf;
+	struct route_job jobs[MAXROUTES];
+	int fd[MAXROUTES], i, m = 0, failed;
+	queue_t q[MAXROUTES];
 
-	while (count > 0) {
-#ifdef HAVE_SSL
-		if(use_tls == True) { 
-			written_bytes = SSL_write(ssl, buf + written_bytes_total, count);
-		} else {
-#endif
-			written_bytes = write(fd, buf + written_bytes_total, count);
-#ifdef HAVE_SSL
+	for(i = 0; i < n; i++) {
+		if(routes[i].rcpts.next == (rcpt_t *)NULL) {
+			continue;
 		}
-#endif
 
-		if (written_bytes < 0) {
-			switch (errno) {
-				case EAGAIN:
-					{
-						int res;
+		q[m] = *tmpl;
+		q[m].host = routes[i].host;
+		q[m].port = routes[i].port;
+		q[m].rcpts = routes[i].rcpts;
 
-						res = ssmtp_poll(fd, POLLOUT, write_timeout);
-						if (res == SSMTP_POLL_SUCCESS) {
-							continue;
-						}
-						return -1;
-					}
-				default:
-					return -1;
+		if(m == 0) {
+			if((fd[0] = queue_spool(&q[0], stdin)) == -1) {
+				return(-1);
+			}
+		}
+		else if((fd[m] = queue_link(&q[m], &q[0])) == -1) {
+			/* All or nothing, stdin is used up */
+			(void)freopen(queue_path(path, "df", q[0].id), "r", stdin);
+			while(m-- > 0) {
+				queue_remove(&q[m]);
 			}
 
-		} else {
-			written_bytes_total += written_bytes;
-			count -= written_bytes;
+			die("Cannot queue message in %s", queue_dir);
 		}
+		m++;
 	}
-	return written_bytes_total;
-#else
-	int fd_flags, ret;
 
-	fd_flags = fcntl(fd, F_GETFL, 0);
-	if (fcntl(fd, F_SETFL, fd_flags &~ O_NONBLOCK) != 0) {
-		log_event(LOG_ERR, "fcntl(, ) failed");
-		return(-1);
+	if((delivery_mode == DM_QUEUE)
+		|| ((delivery_mode == DM_BACKGROUND) && detach())) {
+		for(i = 0; i < m; i++) {
+			log_event(LOG_INFO, "Queued mail %s for %s", q[i].id, q[i].sender);
+			(void)close(fd[i]);
+		}
+
+		return(0);
 	}
 
-#ifdef HAVE_SSL
-	if(use_tls == True) { 
-		ret = SSL_write(ssl, buf, count));
-		if (fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK) != 0) {
-			log_event(LOG_ERR, "fcntl(, ) failed");
-			return(-1);
+	/* The mailhubs are all talked to at once */
+	for(i = 0; i < m; i++) {
+		jobs[i].q = &q[i];
+		jobs[i].fd = &fd[i];
+		ev_spawn(route_queue_task, &jobs[i]);
+	}
+	ev_run();
+
+	for(i = 0, failed = 0; i < m; i++) {
+		if(jobs[i].res == -1) {
+			failed++;
 		}
-		return ret;
 	}
-#endif
-	ret = write(fd, buf, count);
 
-	if (fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK) != 0) {
-		log_event(LOG_ERR, "fcntl(, ) failed");
-		return(-1);
+	*error = '\0';
+	for(i = 0; i < m; i++) {
+		buf = jobs[i].response;
+
+		switch(jobs[i].res) {
+			case 0:
+				/* always output the final reply from the MTA */
+				fprintf(stdout, "%s: %s\n", prog, buf);
+				break;
+
+			case 1:
+			case 2:
+				(void)fprintf(stderr, "%s: %s - queued as %s\n",
+					prog, buf, q[i].id);
+				break;
+
+			default:
+				if(failed < m) {
+					/* The others were sent or queued, a retry of
+					   the whole message would send them twice */
+					(void)freopen(queue_path(path, "df", q[i].id), "r", stdin);
+					route_failed(&q[i].rcpts, buf);
+				}
+				else if(*error == '\0') {
+					/* Let die() save the message to dead.letter */
+					(void)freopen(queue_path(path, "df", q[i].id), "r", stdin);
+					(void)strcpy(error, buf);
+				}
+				else {
+					(void)fprintf(stderr, "%s: %s\n", prog, buf);
+				}
+				queue_remove(&q[i]);
+		}
 	}
-	return ret;
-#endif
+
+	if(*error) {
+		die("%s", error);
+	}
+
+	return(0);
 }
 
 /*
-smtp_write() -- A printf to an fd and append <CR/LF>
+route_send() -- Send the message on stream to each of the n routes at
+	once, keeping its text in a temporary file meanwhile
 */
-void smtp_write(int fd, char *format, ...)
+void route_send(struct route *routes, int n, FILE *stream)
 {
-	char buf[(BUF_SZ + 1)];
-	va_list ap;
+	char error[(BUF_SZ + 1)], path[(MAXPATHLEN + 1)], *p;
+	struct route_job jobs[MAXROUTES];
+	int i, m, failed;
+	FILE *fp;
 
-	va_start(ap, format);
-	if(vsnprintf(buf, (BUF_SZ - 2), format, ap) == -1) {
-		die("smtp_write() -- vsnprintf() failed");
+	if((p = getenv("TMPDIR")) == (char *)NULL) {
+		p = "/tmp";
 	}
-	va_end(ap);
+	(void)snprintf(path, sizeof(path), "%s/ssmtpXXXXXX", p);
 
-	if(log_level > 0) {
-		log_event(LOG_INFO, "%s\n", buf);
+	/* A file with a name, so each task can open it for itself */
+	if(((i = mkstemp(path)) == -1)
+		|| ((fp = fdopen(i, "w+")) == (FILE *)NULL)) {
+		die("Cannot create a temporary file: %s", strerror(errno));
 	}
 
-	if(minus_v) {
-		(void)fprintf(stderr, "[->] %s\n", buf);
+	if((spool_write(fp, stream, True) == -1) || (fflush(fp) == EOF)) {
+		(void)unlink(path);
+		die("Cannot write a temporary file: %s", strerror(errno));
 	}
-	(void)strcat(buf, "\r\n");
 
-	(void)fd_puts(fd, buf, strlen(buf));
-}
+	for(i = 0, m = 0; i < n; i++) {
+		if(routes[i].rcpts.next) {
+			jobs[m].route = &routes[i];
+			jobs[m].path = path;
+			ev_spawn(route_send_task, &jobs[m++]);
+		}
+	}
+	ev_run();
+	(void)unlink(path);
 
-/*
-handler() -- A "normal" non-portable version of an alarm handler
-			Alas, setting a flag and returning is not fully functional in
-			BSD: system calls don't fail when reading from a ``slow'' device
-			like a socket. So we longjump instead, which is erronious on
-			a small number of machines and ill-defined in the language
-*/
-void handler(void)
-{
-	extern jmp_buf TimeoutJmpBuf;
+	for(i = 0, failed = 0; i < m; i++) {
+		if(jobs[i].res == -1) {
+			failed++;
+		}
+	}
+
+	/* Whatever goes to dead.letter comes from the text we sent */
+	if(failed) {
+		(void)dup2(fileno(fp), fileno(stdin));
+	}
 
-	longjmp(TimeoutJmpBuf, (int)1);
+	*error = '\0';
+	for(i = 0; i < m; i++) {
+		if(jobs[i].res == -1) {
+			if(failed < m) {
+				/* The others have it, a retry would send it twice */
+				route_failed(&jobs[i].route->rcpts, jobs[i].response);
+			}
+			else if(*error == '\0') {
+				(void)strcpy(error, jobs[i].response);
+			}
+			else {
+				(void)fprintf(stderr, "%s: %s\n", prog, jobs[i].response);
+			}
+		}
+		else {
+			/* always output the final reply from the MTA */
+			fprintf(stdout, "%s: %s\n", prog, jobs[i].response);
+			log_event(LOG_INFO, "Sent mail for %s (%s)", from_strip(uad),
+				jobs[i].response);
+		}
+	}
+
+	if(*error) {
+		/* None of them got it; let die() save it to dead.letter */
+		(void)fseek(stdin, 0L, SEEK_SET);
+		clearerr(stdin);
+
+		die("%s", error);
+	}
+	(void)fclose(fp);
 }
 
 /*
@@ -1504,12 +5475,11 @@ ssmtp() -- send the message (exactly one) from stdin to the mailhub SMTP port
 */
 int ssmtp(char *argv[])
 {
-	char buf[(BUF_SZ + 1)], *p, *q;
-#ifdef MD5AUTH
-	char challenge[(BUF_SZ + 1)];
-#endif
+	struct route routes[MAXROUTES], *route;
+	char buf[(BUF_SZ + 1)], *p;
 	struct passwd *pw;
-	int i, sock, res;
+	int i, n, used, sock;
+	queue_t q;
 	uid_t uid;
 
 	uid = getuid();
@@ -1534,8 +5504,7 @@ int ssmtp(char *argv[])
 		uad = append_domain(pw->pw_name);
 	}
 
-	ht = &headers;
-	rt = &rcpt_list;
+	rcpt_start(&rcpt_list);
 
 	header_parse(stdin);
 
@@ -1546,192 +5515,99 @@ int ssmtp(char *argv[])
 
 	from = from_format(uad, override_from);
 
-	/* Now to the delivery of the message */
-	(void)signal(SIGALRM, (void(*)())handler);	/* Catch SIGALRM */
-	(void)alarm((unsigned) MAXWAIT);			/* Set initial timer */
-	if(setjmp(TimeoutJmpBuf) != 0) {
-		/* Then the timer has gone off and we bail out */
-		die("Connection lost in middle of processing");
-	}
-
-	if((sock = smtp_open(mailhost, port)) == -1) {
-		die("Cannot open %s:%d", mailhost, port);
-	}
-	else if (use_starttls == False) /* no initial response after STARTTLS */
-	{
-		if(smtp_okay(sock, buf) == False)
-			die("Invalid response SMTP server");
-	}
-
-	/* If user supplied username and password, then try ELHO */
-	if(auth_user) {
-		smtp_write(sock, "EHLO %s", hostname);
-	}
-	else {
-		smtp_write(sock, "HELO %s", hostname);
-	}
-	(void)alarm((unsigned) MEDWAIT);
-
-	if(smtp_okay(sock, buf) == False) {
-		die("%s (%s)", buf, hostname);
-	}
-
-	/* Try to log in if username was supplied */
-	if(auth_user) {
-#ifdef MD5AUTH
-		if(auth_pass == (char *)NULL) {
-			auth_pass = strdup("");
-		}
-
-		if(strcasecmp(auth_method, "cram-md5") == 0) {
-			smtp_write(sock, "AUTH CRAM-MD5");
-			(void)alarm((unsigned) MEDWAIT);
-
-			if(smtp_read(sock, buf) != 3) {
-				die("Server rejected AUTH CRAM-MD5 (%s)", buf);
-			}
-			strncpy(challenge, strchr(buf,' ') + 1, sizeof(challenge));
-
-			memset(buf, 0, sizeof(buf));
-			crammd5(challenge, auth_user, auth_pass, buf);
-		}
-		else {
-#endif
-		    memset(buf, 0, sizeof(buf));
-		    to64frombits(buf, auth_user, strlen(auth_user));
-		    smtp_write(sock, "AUTH LOGIN %s", buf);
-
-		    (void)alarm((unsigned) MEDWAIT);
-		    if(smtp_read(sock, buf) != 3) {
-			die("Server didn't accept AUTH LOGIN (%s)", buf);
-		    }
-		    memset(buf, 0, sizeof(buf));
-
-		    to64frombits(buf, auth_pass, strlen(auth_pass));
-#ifdef MD5AUTH
-		}
-#endif
-		smtp_write(sock, "%s", buf);
-		(void)alarm((unsigned) MEDWAIT);
-
-		if(smtp_okay(sock, buf) == False) {
-			die("Authorization failed (%s)", buf);
-		}
-	}
-
-	/* Send "MAIL FROM:" line */
-	smtp_write(sock, "MAIL FROM:<%s>", uad);
-
-	(void)alarm((unsigned) MEDWAIT);
-
-	if(smtp_okay(sock, buf) == 0) {
-		die("%s", buf);
-	}
-
-	/* Send all the To: adresses */
 	/* Either we're using the -t option, or we're using the arguments */
 	if(minus_t) {
 		if(rcpt_list.next == (rcpt_t *)NULL) {
 			die("No recipients specified although -t option used");
 		}
-		rt = &rcpt_list;
-
-		while(rt->next) {
-			p = rcpt_remap(rt->string);
-			smtp_write(sock, "RCPT TO:<%s>", p);
-
-			(void)alarm((unsigned)MEDWAIT);
-
-			if(smtp_okay(sock, buf) == 0) {
-				die("%s", buf);
-			}
-
-			rt = rt->next;
-		}
 	}
 	else {
 		for(i = 1; (argv[i] != NULL); i++) {
 			p = strtok(argv[i], ",");
 			while(p) {
 				/* RFC822 Address -> "foo@bar" */
-				q = rcpt_remap(addr_parse(p));
-				smtp_write(sock, "RCPT TO:<%s>", q);
-
-				(void)alarm((unsigned) MEDWAIT);
-
-				if(smtp_okay(sock, buf) == 0) {
-					die("%s", buf);
-				}
+				rcpt_save(addr_parse(p));
 
 				p = strtok(NULL, ",");
 			}
 		}
 	}
 
-	/* Send DATA */
-	smtp_write(sock, "DATA");
-	(void)alarm((unsigned) MEDWAIT);
+	/* Local names get their domain now, which may make them one the
+	   list has already */
+	for(rt = &rcpt_list; rt->next; ) {
+		p = rcpt_remap(rt->string);
 
-	if(smtp_read(sock, buf) != 3) {
-		/* Oops, we were expecting "354 send your data" */
-		die("%s", buf);
+		if((p != rt->string) && (rcpt_seen(p, strlen(p), False) == (char *)NULL)) {
+			*rt = *rt->next;
+			continue;
+		}
+		rt->string = p;
+		rt = rt->next;
 	}
 
-	smtp_write(sock,
-		"Received: by %s (sSMTP sendmail emulation); %s", hostname, arpadate);
-
-	if(have_from == False) {
-		smtp_write(sock, "From: %s", from);
+	/* Mail for MXDomains goes to each domain on its own */
+	n = route_split(&rcpt_list, routes, MAXROUTES);
+	for(i = 0, used = 0, route = &routes[0]; i < n; i++) {
+		if(routes[i].rcpts.next) {
+			route = &routes[i];
+			used++;
+		}
 	}
 
-	if(have_date == False) {
-		smtp_write(sock, "Date: %s", arpadate);
-	}
+	/* Now to the delivery of the message */
+	(void)signal(SIGPIPE, SIG_IGN);	/* A mailhub gone is a failed write */
 
-#ifdef HASTO_OPTION
-	if(have_to == False) {
-		smtp_write(sock, "To: postmaster");
-	}
-#endif
+	q.ctime = time((time_t *)NULL);
+	q.host = route->host;
+	q.port = route->port;
+	q.sender = uad;
+	q.rcpts = route->rcpts;
+	q.error = (char *)NULL;
 
-	ht = &headers;
-	while(ht->next) {
-		smtp_write(sock, "%s", ht->string);
-		ht = ht->next;
+	if(queue_dir) {
+		if(route_queue(routes, n, &q) == 0) {
+			return(0);
+		}
+		log_event(LOG_ERR, "Cannot queue message, sending it directly");
+	}
+	else if(delivery_mode != DM_INTERACTIVE) {
+		log_event(LOG_INFO, "No QueueDir, sending mail in the foreground");
 	}
 
-	(void)alarm((unsigned) MEDWAIT);
+	if(used > 1) {
+		route_send(routes, n, stdin);
 
-	/* End of headers, start body */
-	smtp_write(sock, "");
+		return(0);
+	}
 
-	while(fgets(buf, sizeof(buf), stdin)) {
-		/* Trim off \n, double leading .'s */
-		standardise(buf);
+	/* The -bd daemon has a session ready */
+	if(pool_socket && (q.host == mailhost)) {
+		switch(pool_send(&q, stdin, True, buf)) {
+			case 0:
+				fprintf(stdout, "%s: %s\n", prog, buf);
+				log_event(LOG_INFO, "Sent mail for %s (%s)", from_strip(uad), buf);
 
-		smtp_write(sock, "%s", buf);
+				return(0);
+
+			case -1:
+				die("%s", buf);
+		}
+	}
 
-		(void)alarm((unsigned) MEDWAIT);
+	if((sock = smtp_session(q.host, q.port, buf)) == -1) {
+		die("%s", buf);
 	}
-	/* End of body */
 
-	smtp_write(sock, ".");
-	(void)alarm((unsigned) MAXWAIT);
+	if(smtp_message(sock, buf, uad, &q.rcpts, stdin, zero_copy, True) == -1) {
+		die("%s", buf);
+	}
 
-	res = smtp_okay(sock, buf);
 	/* always output the final reply from the MTA */
 	fprintf(stdout, "%s: %s\n", prog, buf);
 
-	if(res == 0) {
-	    die("%s", "");
-	}
-
 	/* Close conection */
-	(void)signal(SIGALRM, SIG_IGN);
-
-	smtp_write(sock, "QUIT");
-	(void)smtp_okay(sock, buf);
-	(void)close(sock);
+	smtp_quit(sock);
 
 	log_event(LOG_INFO, "Sent mail for %s (%s)", from_strip(uad), buf);
 
@@ -1767,7 +5643,7 @@ char **parse_options(int argc, char *argv[])
 
 	if(strcmp(prog, "mailq") == 0) {
 		/* Someone wants to know the queue state... */
-		paq("mailq: Mail queue is empty\n");
+		minus_bp = True;
 	}
 	else if(strcmp(prog, "newaliases") == 0) {
 		/* Someone wanted to rebuild aliases */
@@ -1854,14 +5730,16 @@ char **parse_options(int argc, char *argv[])
 				case 'a':	/* ARPANET mode */
 						paq("-ba is not supported by sSMTP\n");
 				case 'd':	/* Run as a daemon */
-						paq("-bd is not supported by sSMTP\n");
+						minus_bd = True;
+						continue;
 				case 'i':	/* Initialise aliases */
 						paq("%s: Aliases are not used in sSMTP\n", prog);
 				case 'm':	/* Default addr processing */
 						continue;
 
 				case 'p':	/* Print mailqueue */
-						paq("%s: Mail queue is empty\n", prog);
+						minus_bp = True;
+						continue;
 				case 's':	/* Read SMTP from stdin */
 						paq("-bs is not supported by sSMTP\n");
 				case 't':	/* Test mode */
@@ -1993,9 +5871,10 @@ char **parse_options(int argc, char *argv[])
 					paq("%s: Aliases are not used in sSMTP\n", prog);
 
 				/* Deliver now, in background or queue */
-				/* This may warrant a diagnostic for b or q */
 				case 'd':
-						continue;
+						delivery_mode = delivery_parse(&argv[i][++j]);
+						delivery_mode_cmdline = 1;
+						goto exit;
 
 				/* Errors: mail, write or none */
 				case 'e':
@@ -2071,7 +5950,9 @@ char **parse_options(int argc, char *argv[])
 
 			/* Process the queue [at time] */
 			case 'q':
-					paq("%s: Mail queue is empty\n", prog);
+					/* Only once, the interval is ignored */
+					minus_q = True;
+					goto exit;
 
 			/* Read message's To/Cc/Bcc lines */
 			case 't':
@@ -2095,6 +5976,10 @@ char **parse_options(int argc, char *argv[])
 	}
 	new_argv[new_argc] = NULL;
 
+	if(minus_bp || minus_bd || minus_q) {
+		return(&new_argv[0]);
+	}
+
 	if(new_argc <= 1 && !minus_t) {
 		paq("%s: No recipients supplied - mail will not be sent\n", prog);
 	}
@@ -2127,5 +6012,24 @@ int main(int argc, char **argv)
 	}
 	new_argv = parse_options(argc, argv);
 
+	if(minus_bp || minus_bd || minus_q) {
+		if(read_config() == False) {
+			log_event(LOG_INFO, "%s/ssmtp.conf not found", SSMTPCONFDIR);
+		}
+
+		if(minus_bp) {
+			exit(queue_list());
+		}
+
+		if(minus_bd) {
+			exit(pool_daemon());
+		}
+
+		if(queue_dir == (char *)NULL) {
+			paq("%s: Mail queue is empty\n", prog);
+		}
+		exit(queue_run());
+	}
+
 	exit(ssmtp(new_argv));
 }
@@ -6,13 +6,35 @@
 
 */
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <stdio.h>
 #include <pwd.h>
+#ifdef HAVE_SSL
+#include <openssl/ssl.h>
+#endif
 
 #define BUF_SZ  (1024 * 2)	/* A pretty large buffer, but not outrageous */
+#define RBUF_SZ (1024 * 16)	/* Network read buffer, one full TLS record */
+#define WBUF_SZ (1024 * 64)	/* Network write buffer */
+#define CHUNK_SZ (1024 * 1024)	/* Largest BDAT chunk we send */
+#define SESSION_SZ (1024 * 16)	/* Largest TLS session we cache */
+#define ARENA_SZ (1024 * 64)	/* Blocks msg_arena hands memory out of */
+
+#define MAXWAIT (10 * 60)	/* Longest we wait for the -bd daemon, in seconds */
 
-#define MAXWAIT (10 * 60)	/* Maximum wait between commands, in seconds */
-#define MEDWAIT (5 * 60)
+#define MAXPIPELINE 100	/* Most commands sent ahead of their replies */
+#define KEEPALIVE 60		/* NOOP idle pooled sessions this often, in seconds */
+#define MAXADDRS 16		/* Most addresses of a mailhub we try */
+#define CONNECT_DELAY 250	/* Wait before trying the next address, in msec */
+#define MAXHUBS 16		/* Most mailhubs MailHub may list */
+#define HUB_HOLDDOWN (5 * 60)	/* Try a failed mailhub last for this long */
+#define HUB_SLOW 1000		/* Prefer mailhubs quicker to connect, in msec */
+#define MAXROUTES 32		/* Most destinations one message goes to */
+#define DNS_TTL (5 * 60)	/* How long to cache addresses DNS gave no TTL for */
+#define DNS_MAXTTL (24 * 60 * 60)	/* Longest we ever cache addresses */
+#define DNS_WAIT 5		/* Seconds a name server has to answer */
+#define DNS_TRIES 2		/* Times each name server is asked */
+#define BODYWAIT (3 * 60)	/* Longest the writer of a piped body may pause, in seconds */
 
 #define MAXSYSUID 999		/* Highest UID which is a system account */
 
@@ -29,9 +51,145 @@ struct string_list {
 	struct string_list *next;
 };
 
-typedef struct string_list headers_t;
 typedef struct string_list rcpt_t;
 
+/* Memory given back all at once, see arena.c */
+struct arena {
+	struct arena_block *blocks;	/* The one handing out memory first */
+	void *last;		/* The latest allocation, which may still grow */
+};
+
+/* One of the headers we were given, a span of header_buf */
+struct header {
+	size_t off;
+	size_t len;
+};
+
+struct esmtp_ext {
+	char *keyword;
+	bool_t offered;
+	char *params;
+};
+
+/* Indices into esmtp_ext[] */
+enum {
+	EXT_PIPELINING,
+	EXT_SIZE,
+	EXT_8BITMIME,
+	EXT_CHUNKING,
+	EXT_STARTTLS,
+	EXT_AUTH,
+	EXT_COUNT
+};
+
+/* Everything that belongs to one connection to a mailhub; smtp_conn()
+   finds it by the socket */
+struct smtp_conn {
+	int fd;
+	bool_t tls;		/* TLS has been negotiated */
+#ifdef HAVE_SSL
+	SSL *ssl;
+#endif
+	char rbuf[RBUF_SZ];	/* Replies, handed out by fd_gets() */
+	size_t rbuf_pos, rbuf_len;
+	char wbuf[WBUF_SZ];	/* Lines queued by smtp_write() */
+	size_t wbuf_len;
+	char *cbuf;		/* The BDAT chunk, CHUNK_SZ once allocated */
+	size_t cbuf_len;
+	int pipelined;		/* Commands whose replies are still unread */
+	bool_t use_bdat;	/* Message goes out with BDAT (RFC3030) */
+	bool_t mid_message;	/* Message text started, not finished */
+	struct esmtp_ext ext[(EXT_COUNT + 1)];	/* What EHLO offered */
+	char *host;		/* The mailhub, of the ones MailHub lists */
+	int port;
+	long deadline;		/* When the reply being read is late, in msec() */
+};
+
+
+/* ZeroCopy setting: what the message on stdin already looks like */
+enum {
+	ZC_OFF,
+	ZC_CRLF,		/* <CR/LF> line breaks, as BDAT wants them */
+	ZC_STUFFED		/* ...and dot-stuffed, as DATA wants them */
+};
+
+/* DeliveryMode setting, as in sendmail's -od */
+enum {
+	DM_INTERACTIVE,		/* Send it before returning */
+	DM_BACKGROUND,		/* Queue it and send it from a child */
+	DM_QUEUE		/* Only queue it, for the next -q run */
+};
+
+/* zc_kind() results */
+enum {
+	ZC_NONE,
+	ZC_REGULAR,		/* sendfile() */
+	ZC_FIFO			/* splice() */
+};
+
+/* A message waiting in QueueDir: its envelope lives in qf<id>,
+   the text in df<id> */
+struct queue_entry {
+	char id[64];
+	time_t ctime;
+	int format;		/* What df<id> looks like, a ZeroCopy value */
+	char *host;		/* Mailhub and port it was submitted for */
+	int port;
+	char *sender;
+	rcpt_t rcpts;
+	char *error;		/* Why the last attempt failed */
+	long size;		/* Length of the text a -bd client sends */
+};
+
+typedef struct queue_entry queue_t;
+
+/* Where some of the recipients go, see route_split() */
+struct route {
+	char *host;
+	int port;
+	rcpt_t rcpts;
+	rcpt_t *last;		/* The empty entry that ends rcpts */
+};
+
+/* The delivery of one route, run as a task, see route_send() */
+struct route_job {
+	struct route *route;
+	char *path;		/* The message text */
+	queue_t *q;		/* Or its queue entry, see route_queue() */
+	int *fd;
+	int res;
+	char response[(BUF_SZ + 1)];
+};
+
+/* A Route setting, see route_split() */
+struct route_rule {
+	char *domain;		/* With a leading dot, any domain below it */
+	char *hubs;		/* As for MailHub */
+};
+
+/* How many queued messages there are for a mailhub, see queue_run() */
+struct queue_hub {
+	char *host;
+	int port;
+	int count;
+};
+
+/* One of the mailhubs MailHub lists, see hub_list() */
+struct hub {
+	char *host;
+	int port;
+	int weight;
+	int pref;		/* Only tried once those with a lower one fail */
+	int failures;		/* Connections that failed in a row */
+	time_t failed;		/* When the last one did */
+	long latency;		/* Average time to connect, in msec */
+};
+
+/* One address of a mailhub, see hub_resolve() */
+struct hub_addr {
+	struct sockaddr_storage sa;
+	socklen_t len;
+};
 
 /* arpadate.c */
 void get_arpadate(char *);
@@ -39,3 +197,32 @@ void get_arpadate(char *);
 /* base64.c */
 void to64frombits(unsigned char *, const unsigned char *, int);
 int from64tobits(char *, const char *);
+
+/* zerocopy.c */
+int zc_kind(int);
+ssize_t zc_avail(int, int);
+ssize_t zc_move(int, int, int, size_t);
+
+/* arena.c */
+void *arena_alloc(struct arena *, size_t);
+void *arena_grow(struct arena *, void *, size_t, size_t);
+char *arena_strdup(struct arena *, const char *);
+void arena_reset(struct arena *);
+
+/* scan.c */
+char *scan_body(char *, char *, char, bool_t);
+
+/* peer.c */
+int peer_uid(int, uid_t *);
+
+/* event.c */
+struct pollfd;
+long msec(void);
+int ev_left(long);
+int ev_poll(struct pollfd *, int, int);
+void ev_spawn(void (*)(void *), void *);
+void ev_run(void);
+
+/* ssmtp.c */
+void log_event(int, char *, ...);
+void die(char *, ...);
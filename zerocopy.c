@@ -0,0 +1,105 @@
+/*
+
+ zerocopy.c -- move message text from a file or pipe to the mailhub socket
+               with sendfile()/splice(), without copying it through our
+               own buffers
+
+ This lives apart from ssmtp.c because splice() needs _GNU_SOURCE, which
+ would also pull in the GNU basename() prototype.
+
+ See COPYRIGHT for the license
+
+*/
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include "ssmtp.h"
+
+/*
+zc_kind() -- Find out if fd can be moved without copying
+*/
+int zc_kind(int fd)
+{
+	struct stat st;
+
+	if(fstat(fd, &st) == -1) {
+		return(ZC_NONE);
+	}
+
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+	if(S_ISREG(st.st_mode)) {
+		return(ZC_REGULAR);
+	}
+#endif
+
+#ifdef HAVE_SPLICE
+	if(S_ISFIFO(st.st_mode)) {
+#ifdef F_SETPIPE_SZ
+		/* Bigger pipes mean fewer and larger chunks; failure is harmless */
+		(void)fcntl(fd, F_SETPIPE_SZ, CHUNK_SZ);
+#endif
+		return(ZC_FIFO);
+	}
+#endif
+
+	return(ZC_NONE);
+}
+
+/*
+zc_avail() -- Wait up to timeout msec for data on a pipe and say how
+	much is there.  Returns 0 at EOF and -1 on error or, with errno
+	ETIMEDOUT, if the writer took too long
+*/
+ssize_t zc_avail(int fd, int timeout)
+{
+	struct pollfd fds[1];
+	int n;
+
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+
+	switch(ev_poll(fds, 1, timeout)) {
+		case -1:
+			return(-1);
+
+		case 0:
+			errno = ETIMEDOUT;
+			return(-1);
+	}
+
+	if(ioctl(fd, FIONREAD, &n) == -1) {
+		return(-1);
+	}
+
+	return(n);
+}
+
+/*
+zc_move() -- Move up to count bytes from in_fd to out_fd in one call
+*/
+ssize_t zc_move(int out_fd, int in_fd, int kind, size_t count)
+{
+	switch(kind) {
+#if defined(HAVE_SENDFILE) && defined(HAVE_SYS_SENDFILE_H)
+		case ZC_REGULAR:
+			return(sendfile(out_fd, in_fd, (off_t *)NULL, count));
+#endif
+#ifdef HAVE_SPLICE
+		case ZC_FIFO:
+			return(splice(in_fd, (loff_t *)NULL, out_fd, (loff_t *)NULL,
+				count, (SPLICE_F_MOVE | SPLICE_F_MORE)));
+#endif
+	}
+
+	errno = EINVAL;
+	return(-1);
+}